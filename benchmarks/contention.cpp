@@ -0,0 +1,133 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+
+/* Allocator contention: 1..N threads run the same temporary-heavy loop with a StackVector,
+** an uninitialised new[] buffer and a StackVector forced onto its heap fallback. Reports
+** throughput and per operation latency percentiles for each thread count.
+** Linux only. Build: g++ -O2 -std=c++14 -I.. contention.cpp -o contention -lpthread
+** Usage: contention [max threads = hardware threads] [operations per thread = 200000] */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "stackvector.h"
+
+typedef std::chrono::steady_clock Clock;
+
+enum class Kind { Stack, Std, Heap };
+
+static const char *kindName(Kind kind)
+{
+	switch (kind) {
+		case Kind::Stack: return "StackVector";
+		case Kind::Std:   return "new int[]";
+		default:          return "heap fallback";
+	}
+}
+
+// One unit of work: a temporary of 16..4096 ints, one element per cache line written and read back,
+// so that the allocation rather than the fill dominates
+template <Kind kind> static int operation(size_t count)
+{
+	int sum = 0;
+	if (Kind::Std == kind) {
+		// left uninitialised like the StackVector below, std::vector<int>(count) would zero-fill it
+		std::unique_ptr<int[]> temporary(new int[count]);
+		for (size_t i = 0; i < count; i += 16)
+			temporary[i] = int(i);
+		for (size_t i = 0; i < count; i += 16)
+			sum += temporary[i];
+	} else {
+		// a reserve larger than any stack forces the heap path
+		StackVector<int> temporary(count, Kind::Heap == kind ? SIZE_MAX / 2 : 16 * 1024, false);
+		for (size_t i = 0; i < count; i += 16)
+			temporary[i] = int(i);
+		for (size_t i = 0; i < count; i += 16)
+			sum += temporary[i];
+	}
+	return sum;
+}
+
+template <Kind kind> static void worker(size_t operations, uint32_t seed, std::atomic<int> &start, float *nanos, int *sink)
+{
+	int sum = 0;
+	while (0 == start.load(std::memory_order_acquire))
+		;
+
+	for (size_t op = 0; op < operations; op++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		const Clock::time_point t0 = Clock::now();
+		sum += operation<kind>(16 + seed % 4081);
+		nanos[op] = std::chrono::duration<float, std::nano>(Clock::now() - t0).count();
+	}
+	*sink = sum;
+}
+
+static void run(Kind kind, size_t threads, size_t operations)
+{
+	std::vector<float> nanos(threads * operations);
+	std::vector<int> sinks(threads);
+	std::vector<std::thread> pool;
+	std::atomic<int> start(0);
+
+	for (size_t t = 0; t < threads; t++) {
+		float *slice = &nanos[t * operations];
+		switch (kind) {
+			case Kind::Stack: pool.emplace_back(worker<Kind::Stack>, operations, uint32_t(t + 1), std::ref(start), slice, &sinks[t]); break;
+			case Kind::Std:   pool.emplace_back(worker<Kind::Std>, operations, uint32_t(t + 1), std::ref(start), slice, &sinks[t]); break;
+			case Kind::Heap:  pool.emplace_back(worker<Kind::Heap>, operations, uint32_t(t + 1), std::ref(start), slice, &sinks[t]); break;
+		}
+	}
+
+	const Clock::time_point t0 = Clock::now();
+	start.store(1, std::memory_order_release);
+	for (std::thread &thread : pool)
+		thread.join();
+	const double seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+
+	std::sort(nanos.begin(), nanos.end());
+	const size_t total = nanos.size();
+	printf("%8zu %14s %12.2f %10.0f %10.0f %10.0f\n", threads, kindName(kind), total / seconds / 1e6,
+		nanos[total / 2], nanos[std::min(total - 1, total * 99 / 100)], nanos[std::min(total - 1, total * 999 / 1000)]);
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+	const size_t maxThreads = argc > 1 ? atoi(argv[1]) : hardware;
+	const size_t operations = argc > 2 ? atoi(argv[2]) : 200000;
+	const Kind kinds[] = { Kind::Stack, Kind::Std, Kind::Heap };
+
+	printf("%8s %14s %12s %10s %10s %10s\n", "threads", "storage", "Mops/s", "p50(ns)", "p99(ns)", "p999(ns)");
+
+	// powers of two, always finishing with maxThreads even if it is not one
+	std::vector<size_t> threadCounts;
+	for (size_t threads = 1; threads < maxThreads; threads *= 2)
+		threadCounts.push_back(threads);
+	threadCounts.push_back(std::max(size_t(1), maxThreads));
+
+	for (size_t threads : threadCounts) {
+		for (Kind kind : kinds)
+			run(kind, threads, operations);
+	}
+
+	return 0;
+}
@@ -0,0 +1,106 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+
+/* Coroutine pipeline where every stage keeps a temporary buffer alive across a co_await,
+** once with CoroutineVector (arena behind the frame) and once with std::vector. Both stages
+** hoist the data pointer, GCC doesn't keep members of frame locals in registers across the loop.
+** Build: g++ -O2 -std=c++20 -I.. coroutine.cpp -o coroutine
+** Usage: coroutine [messages, default 1000000] [buffer elements, default 256] */
+
+#include <chrono>
+#include <vector>
+#include "stackcoroutine.h"
+
+/* Minimal lazily started task that the driver resumes by hand, standing in for an I/O loop */
+struct Handler
+{
+	struct promise_type : CoroutineArenaPromise<16 * 1024>
+	{
+		long result = 0;
+
+		Handler get_return_object() { return Handler(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_value(long value) { result = value; }
+		void unhandled_exception() { abort(); }
+	};
+
+	explicit Handler(std::coroutine_handle<promise_type> handle) : _handle(handle) { }
+	Handler(Handler &&other) : _handle(other._handle) { other._handle = nullptr; }
+	~Handler() { if (_handle) _handle.destroy(); }
+
+	long run() {
+		while (!_handle.done())
+			_handle.resume();
+		return _handle.promise().result;
+	}
+
+	std::coroutine_handle<promise_type> _handle;
+};
+
+static Handler arenaStage(const size_t elements, const int message)
+{
+	CoroutineArena &arena = co_await CoroutineArena::current();
+	CoroutineVector<int> buffer(elements, arena, false);
+	int *data = &buffer[0];
+	for (size_t i = 0; i < elements; i++)
+		data[i] = int(i) ^ message;
+	co_await std::suspend_always();	// "waiting for the socket"
+	long sum = 0;
+	for (size_t i = 0; i < elements; i++)
+		sum += data[i];
+	co_return sum;
+}
+
+static Handler vectorStage(const size_t elements, const int message)
+{
+	std::vector<int> buffer(elements);
+	int *data = buffer.data();
+	for (size_t i = 0; i < elements; i++)
+		data[i] = int(i) ^ message;
+	co_await std::suspend_always();
+	long sum = 0;
+	for (size_t i = 0; i < elements; i++)
+		sum += data[i];
+	co_return sum;
+}
+
+template <typename Stage> static double measure(Stage stage, const int messages, const size_t elements, long &checksum)
+{
+	typedef std::chrono::steady_clock clock;
+	const clock::time_point t0 = clock::now();
+	checksum = 0;
+	for (int message = 0; message < messages; message++) {
+		Handler handler = stage(elements, message);
+		checksum += handler.run();
+	}
+	return std::chrono::duration<double, std::nano>(clock::now() - t0).count() / messages;
+}
+
+int main(int argc, char *argv[])
+{
+	const int messages = argc > 1 ? atoi(argv[1]) : 1000000;
+	const size_t elements = argc > 2 ? size_t(atol(argv[2])) : 256;
+	long arenaChecksum, vectorChecksum;
+
+	const double arenaNanos = measure(arenaStage, messages, elements, arenaChecksum);
+	const double vectorNanos = measure(vectorStage, messages, elements, vectorChecksum);
+
+	printf("%zu elements per message\n", elements);
+	printf("CoroutineVector: %8.1f ns/message (checksum %ld)\n", arenaNanos, arenaChecksum);
+	printf("std::vector:     %8.1f ns/message (checksum %ld)\n", vectorNanos, vectorChecksum);
+	return 0;
+}
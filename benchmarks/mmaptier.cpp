@@ -0,0 +1,70 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+
+/* Large heap-backed temporaries: malloc tier versus the mmap tier, with and without huge pages.
+** Each sample value-initialises a StackVector<int>, writes every 4096th element (every fourth page, as
+** in a lookup table) and destroys it. Linux only.
+** Build: g++ -O2 -std=c++17 -I.. mmaptier.cpp -o mmaptier
+** Usage: mmaptier [largest size in MB, default 1024] [runs, default 5] */
+
+#include <chrono>
+#include "stackvector.h"
+
+static double sample(const size_t bytes, const size_t stride, bool &mapped)
+{
+	typedef std::chrono::steady_clock clock;
+	const clock::time_point t0 = clock::now();
+	{
+		// force the heap tier by leaving no room on stack
+		StackVector<int> buffer(bytes / sizeof(int), SIZE_MAX / 2);
+		for (size_t i = 0; i < buffer.count(); i += stride)
+			buffer[i] = int(i);
+		asm volatile("" : : "r"(&buffer[0]) : "memory");
+		mapped = buffer.isMapped();
+	}
+	return std::chrono::duration<double, std::milli>(clock::now() - t0).count();
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t largestMB = argc > 1 ? size_t(atol(argv[1])) : 1024;
+	const int runs = argc > 2 ? atoi(argv[2]) : 5;
+	struct { const char *name; size_t threshold; bool hugePages; } tiers[] = {
+		{ "malloc", 0, false },
+		{ "mmap", 1, false },
+		{ "mmap+thp", 1, true },
+	};
+
+	printf("%8s %10s %8s %14s %14s\n", "MB", "tier", "mapped", "sparse(ms)", "dense(ms)");
+
+	for (size_t mb = 1; mb <= largestMB; mb *= 4) {
+		for (auto &tier : tiers) {
+			StackHeap::mapThreshold() = tier.threshold;
+			StackHeap::mapHugePages() = tier.hugePages;
+
+			double sparse = 0, dense = 0;
+			bool mapped = false;
+			for (int run = 0; run < runs; run++) {
+				sparse += sample(mb * 1024 * 1024, 4096, mapped);
+				dense += sample(mb * 1024 * 1024, 1, mapped);
+			}
+
+			printf("%8zu %10s %8d %14.2f %14.2f\n", mb, tier.name, mapped, sparse / runs, dense / runs);
+		}
+	}
+
+	return 0;
+}
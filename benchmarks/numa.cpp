@@ -0,0 +1,147 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+
+/* NUMA placement of heap tier blocks. A vector is constructed on a thread pinned to node A,
+** while a thread on node B either touched its pages first ("handoff", fresh mapped block
+** filled by another thread) or freed the same block just before ("recycled", malloc reuse).
+** For each StackHeapNuma mode the constructing thread then sweeps the block; the report shows
+** construction and sweep time and the share of pages that ended up on node A. On a single node
+** box A and B coincide, so only the overhead of the modes is measured.
+** Linux only. Build: g++ -O2 -std=c++14 -I.. numa.cpp -o numa -lpthread
+** Usage: numa [block MB = 64] [runs = 5] */
+
+#include <chrono>
+#include <cstring>
+#include <linux/mempolicy.h>
+#include <malloc.h>
+#include <sched.h>
+#include <thread>
+#include <vector>
+#include "stackvector.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// First CPU of every online node, in node order
+static std::vector<int> nodeCpus()
+{
+	std::vector<int> cpus;
+	for (int node = 0; node < 1024; node++) {
+		char path[96];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *list = fopen(path, "r");
+		if (!list)
+			continue;
+		int cpu = -1;
+		if (1 == fscanf(list, "%d", &cpu) && cpu >= 0)
+			cpus.push_back(cpu);
+		fclose(list);
+	}
+	if (cpus.empty())
+		cpus.push_back(0);
+	return cpus;
+}
+
+static void pin(int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Runs work on a new thread pinned to cpu and waits for it
+template <typename W> static void onCpu(int cpu, W work)
+{
+	std::thread thread([cpu, &work]() { pin(cpu); work(); });
+	thread.join();
+}
+
+static double localShare(const char *memory, size_t bytes, int node)
+{
+	const size_t page = StackProbe::pageSize();
+	size_t local = 0, pages = 0;
+	for (size_t offset = 0; offset < bytes; offset += 16 * page, pages++) {
+		int where = -1;
+		void *address = const_cast<char *>(memory) + offset;
+		if (0 == syscall(SYS_get_mempolicy, &where, nullptr, 0, address, MPOL_F_NODE | MPOL_F_ADDR) && where == node)
+			local++;
+	}
+	return pages ? 100.0 * local / pages : 0.0;
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t bytes = size_t(argc > 1 ? atoi(argv[1]) : 64) * 1024 * 1024;
+	const int runs = argc > 2 ? atoi(argv[2]) : 5;
+	const std::vector<int> cpus = nodeCpus();
+	const int cpuA = cpus.front(), cpuB = cpus.back();
+	const StackHeapNuma modes[] = { StackHeapNuma::None, StackHeapNuma::FirstTouch, StackHeapNuma::Bind };
+	const char *modeNames[] = { "none", "first touch", "bind" };
+
+	// one arena that keeps freed blocks, so the recycled case really gets node B's pages back
+	mallopt(M_ARENA_MAX, 1);
+	mallopt(M_MMAP_THRESHOLD, 1024 * 1024 * 1024);
+	mallopt(M_TRIM_THRESHOLD, 1024 * 1024 * 1024);
+
+	printf("%zu nodes, constructing on cpu %d, other thread on cpu %d%s\n", cpus.size(), cpuA, cpuB, cpus.size() < 2 ? " (single node, placement can't differ)" : "");
+	printf("%10s %12s %14s %10s %8s\n", "scenario", "mode", "construct(us)", "sweep(us)", "local");
+
+	for (int scenario = 0; scenario < 2; scenario++) {
+		const bool recycled = 1 == scenario;
+		StackHeap::mapThreshold() = recycled ? 0 : 1;
+
+		for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+			double construct = 0, sweep = 0, local = 0;
+			StackHeap::numaPlacement() = modes[m];
+
+			for (int run = 0; run < runs; run++) {
+				if (recycled) {
+					onCpu(cpuB, [bytes]() {
+						char *block = static_cast<char *>(malloc(bytes));
+						memset(block, 1, bytes);
+						free(block);
+					});
+				}
+
+				StackVector<char> *vector = nullptr;
+				int node = -1;
+				onCpu(cpuA, [&]() {
+					// not on the stack itself, so this always takes the heap tier
+					const Clock::time_point t0 = Clock::now();
+					vector = new StackVector<char>(bytes, 16 * 1024, false);
+					construct += std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+					node = StackHeap::currentNode();
+				});
+
+				if (!recycled)
+					onCpu(cpuB, [vector, bytes]() { memset(&(*vector)[0], 2, bytes); });
+
+				onCpu(cpuA, [&]() {
+					const Clock::time_point t0 = Clock::now();
+					memset(&(*vector)[0], 3, bytes);
+					sweep += std::chrono::duration<double, std::micro>(Clock::now() - t0).count();
+					local += localShare(&(*vector)[0], bytes, node);
+				});
+
+				delete vector;
+			}
+
+			printf("%10s %12s %14.0f %10.0f %7.1f%%\n", recycled ? "recycled" : "handoff", modeNames[m], construct / runs, sweep / runs, local / runs);
+		}
+	}
+
+	return 0;
+}
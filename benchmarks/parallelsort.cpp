@@ -0,0 +1,78 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+
+/* parallelSort() against std::sort() on the same heap-backed StackVector of random ints,
+** for pools of 1 .. hardware threads.
+** Linux only. Build: g++ -O2 -std=c++14 -I.. parallelsort.cpp -o parallelsort -lpthread
+** Usage: parallelsort [elements = 500000] [runs = 5] */
+
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+#include "stackparallel.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static void fill(StackVector<int> &vector, uint32_t seed)
+{
+	std::mt19937 random(seed);
+	for (size_t i = 0; i < vector.count(); i++)
+		vector[i] = int(random());
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t count = argc > 1 ? atoi(argv[1]) : 500000;
+	const int runs = argc > 2 ? atoi(argv[2]) : 5;
+	const size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+
+	// a reserve larger than any stack keeps the vector on the heap, as in the motivating case
+	StackVector<int> vector(count, SIZE_MAX / 2, false);
+
+	double serial = 0;
+	for (int run = 0; run < runs; run++) {
+		fill(vector, run);
+		int *data = &vector[0];
+		const Clock::time_point t0 = Clock::now();
+		std::sort(data, data + count);
+		serial += std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+	}
+	printf("%8s %10s %8s\n", "threads", "ms", "speedup");
+	printf("%8s %10.2f %8.2f\n", "serial", serial / runs, 1.0);
+
+	// powers of two, always finishing with the hardware thread count even if it is not one
+	std::vector<size_t> threadCounts;
+	for (size_t threads = 1; threads < hardware; threads *= 2)
+		threadCounts.push_back(threads);
+	threadCounts.push_back(hardware);
+
+	for (size_t threads : threadCounts) {
+		StackTaskPool pool(threads);
+		double parallel = 0;
+		for (int run = 0; run < runs; run++) {
+			fill(vector, run);
+			const Clock::time_point t0 = Clock::now();
+			parallelSort(vector, std::less<int>(), pool);
+			parallel += std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+			if (!std::is_sorted(&vector[0], &vector[0] + count))
+				return 1;
+		}
+		printf("%8zu %10.2f %8.2f\n", threads, parallel / runs, serial / parallel);
+	}
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+
+/* Fill latency and page faults of a large on-stack StackVector in each prefault mode.
+** Every sample runs on a fresh thread so its stack pages have never been touched before, unless
+** the sample is warm: the thread then first prefaults a vector of the same size and drops it.
+** Linux only. Build: g++ -O2 -std=c++17 -I.. prefault.cpp -o prefault -lpthread */
+
+#include <chrono>
+#include <cstring>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "stackvector.h"
+
+struct Sample
+{
+	size_t              bytes;
+	StackVectorPrefault mode;
+	bool                warm;
+	double              constructMicros;
+	double              fillMicros;
+	long                constructFaults;
+	long                fillFaults;
+	bool                onStack;
+};
+
+static long minorFaults()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_minflt;
+}
+
+// Runs one frame below runSample(), so its vector covers the pages the measured one will use
+static __attribute__((noinline)) void warmUp(const size_t bytes)
+{
+	StackVector<char> buffer(bytes, 16 * 1024, false, StackVectorPrefault::Always);
+	asm volatile("" : : "r"(buffer.isValid() ? &buffer[0] : nullptr) : "memory");
+}
+
+static const char *modeName(const StackVectorPrefault mode)
+{
+	switch (mode) {
+	case StackVectorPrefault::None: return "none";
+	case StackVectorPrefault::Auto: return "auto";
+	default: return "always";
+	}
+}
+
+static void *runSample(void *arg)
+{
+	Sample *sample = static_cast<Sample *>(arg);
+	typedef std::chrono::steady_clock clock;
+
+	if (sample->warm)
+		warmUp(sample->bytes);
+
+	const long faults0 = minorFaults();
+	const clock::time_point t0 = clock::now();
+	StackVector<char> buffer(sample->bytes, 16 * 1024, false, sample->mode);
+	const clock::time_point t1 = clock::now();
+	const long faults1 = minorFaults();
+
+	for (size_t i = 0; i < sample->bytes; i++)
+		buffer[i] = char(i);
+	asm volatile("" : : "r"(&buffer[0]) : "memory");
+
+	const clock::time_point t2 = clock::now();
+	const long faults2 = minorFaults();
+
+	sample->constructMicros = std::chrono::duration<double, std::micro>(t1 - t0).count();
+	sample->fillMicros = std::chrono::duration<double, std::micro>(t2 - t1).count();
+	sample->constructFaults = faults1 - faults0;
+	sample->fillFaults = faults2 - faults1;
+	sample->onStack = buffer.isAllocatedOnStack();
+	return nullptr;
+}
+
+int main(int argc, char *argv[])
+{
+	const int runs = argc > 1 ? atoi(argv[1]) : 50;
+	const size_t sizes[] = { 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+	const StackVectorPrefault modes[] = { StackVectorPrefault::None, StackVectorPrefault::Auto, StackVectorPrefault::Always };
+
+	printf("%10s %8s %5s %6s %14s %12s %14s %12s\n", "bytes", "prefault", "warm", "stack", "construct(us)", "faults", "fill(us)", "faults");
+
+	for (size_t bytes : sizes) {
+		for (int warm = 0; warm < 2; warm++) {
+			for (StackVectorPrefault mode : modes) {
+				Sample total = { bytes, mode, 0 != warm, 0, 0, 0, 0, false };
+
+				for (int run = 0; run < runs; run++) {
+					Sample sample = { bytes, mode, 0 != warm, 0, 0, 0, 0, false };
+					pthread_attr_t attr;
+					pthread_t thread;
+					pthread_attr_init(&attr);
+					pthread_attr_setstacksize(&attr, 16 * 1024 * 1024);
+					pthread_create(&thread, &attr, runSample, &sample);
+					pthread_join(thread, nullptr);
+					pthread_attr_destroy(&attr);
+
+					total.constructMicros += sample.constructMicros;
+					total.fillMicros += sample.fillMicros;
+					total.constructFaults += sample.constructFaults;
+					total.fillFaults += sample.fillFaults;
+					total.onStack = sample.onStack;
+				}
+
+				printf("%10zu %8s %5d %6d %14.1f %12.1f %14.1f %12.1f\n", bytes, modeName(mode), warm, total.onStack,
+					total.constructMicros / runs, double(total.constructFaults) / runs, total.fillMicros / runs, double(total.fillFaults) / runs);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,112 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+
+/* Iterating a StackVector of pointers to shuffled heap objects with plain forEach versus
+** forEachPrefetched at several distances. Cache misses are read from perf_event_open when the
+** kernel lets us, timing is always reported. Linux only.
+** Build: g++ -O2 -std=c++17 -I.. prefetch.cpp -o prefetch
+** Usage: prefetch [objects, default 2000000] [runs, default 5] */
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "stackvector.h"
+
+struct Object
+{
+	long  value;
+	char  payload[56];
+};
+
+class MissCounter
+{
+public:
+	MissCounter() {
+		struct perf_event_attr attr = {};
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		_fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+	}
+	~MissCounter() { if (_fd >= 0) close(_fd); }
+
+	bool isAvailable() const { return _fd >= 0; }
+	void start() { if (_fd >= 0) { ioctl(_fd, PERF_EVENT_IOC_RESET, 0); ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0); } }
+	long stop() {
+		long long misses = -1;
+		if (_fd >= 0) {
+			ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (sizeof(misses) != read(_fd, &misses, sizeof(misses)))
+				misses = -1;
+		}
+		return long(misses);
+	}
+
+private:
+	int _fd;
+};
+
+int main(int argc, char *argv[])
+{
+	const size_t count = argc > 1 ? size_t(atol(argv[1])) : 2000000;
+	const int runs = argc > 2 ? atoi(argv[2]) : 5;
+	const size_t distances[] = { 0, 2, 4, 8, 16, 32 };
+	std::mt19937 random(42);
+
+	// allocate individually, then shuffle so consecutive pointers land on unrelated cache lines
+	std::vector<Object *> objects(count);
+	for (size_t i = 0; i < count; i++) {
+		objects[i] = new Object();
+		objects[i]->value = long(i);
+	}
+	std::shuffle(objects.begin(), objects.end(), random);
+
+	StackVector<Object *> vector(count, 32 * 1024, false);
+	std::copy(objects.begin(), objects.end(), &vector[0]);
+
+	MissCounter counter;
+	printf("%10s %12s %16s\n", "distance", "ns/object", counter.isAvailable() ? "misses/object" : "misses n/a");
+
+	for (size_t distance : distances) {
+		double nanos = 0;
+		long misses = 0, sum = 0;
+		for (int run = 0; run < runs; run++) {
+			const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+			counter.start();
+			if (0 == distance)
+				vector.forEach([&sum](Object *&object, size_t) { sum += object->value; });
+			else
+				vector.forEachPrefetched([&sum](Object *&object, size_t) { sum += object->value; }, distance);
+			misses += counter.stop();
+			nanos += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+		}
+		if (counter.isAvailable())
+			printf("%10zu %12.2f %16.3f (checksum %ld)\n", distance, nanos / runs / count, double(misses) / runs / count, sum);
+		else
+			printf("%10zu %12.2f %16s (checksum %ld)\n", distance, nanos / runs / count, "-", sum);
+	}
+
+	for (Object *object : objects)
+		delete object;
+	return 0;
+}
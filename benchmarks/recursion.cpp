@@ -0,0 +1,140 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+
+/* Deep recursion stress test for the stack reserve logic. Every frame constructs a StackVector
+** of random size; the report shows, per recursion depth and mustLeaveStackSizeForScope, how
+** many frames fell back to the heap, the constructor latency percentiles and the peak stack
+** use. Each run happens in a forked child on a thread with a fixed stack size, so running
+** out of stack shows up as "overflow" with the level reached instead of taking the harness
+** down. mustLeaveStackSizeForScope only guards the scope that constructs the vector: once
+** vectors fall back to the heap, the frames themselves still eat the remaining stack.
+** Linux only. Build: g++ -O2 -std=c++14 -I.. recursion.cpp -o recursion -lpthread
+** Usage: recursion [stack KB = 2048] [largest vector bytes = 8192] [seed = 1] */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "stackvector.h"
+#include "stackwatermark.h"
+
+struct Run
+{
+	size_t   depth;
+	size_t   mustLeave;
+	size_t   largest;
+	uint32_t seed;
+	size_t   fallbacks;
+	size_t   reached;
+	size_t   highWater;
+	double  *nanos; // one slot per frame, shared with the parent
+};
+
+__attribute__((noinline)) static size_t recurse(Run &run, size_t level, uint32_t random)
+{
+	typedef std::chrono::steady_clock clock;
+
+	random ^= random << 13;
+	random ^= random >> 17;
+	random ^= random << 5;
+	const size_t bytes = 1 + random % run.largest;
+
+	const clock::time_point t0 = clock::now();
+	StackVector<char> buffer(bytes, run.mustLeave, false);
+	const clock::time_point t1 = clock::now();
+
+	run.nanos[level] = std::chrono::duration<double, std::nano>(t1 - t0).count();
+	run.reached = level + 1;
+	if (!buffer.isAllocatedOnStack())
+		run.fallbacks++;
+
+	memset(&buffer[0], int(level), bytes);
+
+	size_t sum = buffer[bytes - 1];
+	if (level + 1 < run.depth)
+		sum += recurse(run, level + 1, random);
+
+	// keep the buffer alive across the recursive call
+	asm volatile("" : : "r"(&buffer[0]) : "memory");
+	return sum + buffer[0];
+}
+
+static void *runThread(void *arg)
+{
+	Run *run = static_cast<Run *>(arg);
+	StackWatermark::paint();
+	recurse(*run, 0, run->seed);
+	run->highWater = StackWatermark::highWater();
+	return nullptr;
+}
+
+static double percentile(double *sorted, size_t count, double p)
+{
+	return sorted[std::min(count - 1, size_t(p * count))];
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t stackBytes = (argc > 1 ? atoi(argv[1]) : 2048) * 1024;
+	const size_t largest = argc > 2 ? atoi(argv[2]) : 8192;
+	const uint32_t seed = argc > 3 ? atoi(argv[3]) : 1;
+	const size_t depths[] = { 64, 256, 512, 1024, 4096 };
+	const size_t mustLeaves[] = { 0, 1024, 4 * 1024, 16 * 1024, 64 * 1024 };
+
+	printf("stack %zu KB, vectors of 1..%zu bytes\n", stackBytes / 1024, largest);
+	printf("%6s %10s %10s %10s %10s %10s %10s %12s\n", "depth", "mustLeave", "fallback", "p50(ns)", "p99(ns)", "p999(ns)", "max(ns)", "peak stack");
+
+	for (size_t depth : depths) {
+		for (size_t mustLeave : mustLeaves) {
+			// the child writes its results into a shared mapping
+			const size_t sharedBytes = sizeof(Run) + depth * sizeof(double);
+			void *shared = mmap(nullptr, sharedBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+			if (MAP_FAILED == shared)
+				return 1;
+			Run *run = new (shared) Run{ depth, mustLeave, largest, seed, 0, 0, 0, reinterpret_cast<double *>(static_cast<char *>(shared) + sizeof(Run)) };
+
+			const pid_t child = fork();
+			if (0 == child) {
+				pthread_attr_t attr;
+				pthread_t thread;
+				pthread_attr_init(&attr);
+				pthread_attr_setstacksize(&attr, stackBytes);
+				pthread_create(&thread, &attr, runThread, run);
+				pthread_join(thread, nullptr);
+				_exit(0);
+			}
+
+			int status = 0;
+			waitpid(child, &status, 0);
+
+			if (WIFEXITED(status) && 0 == WEXITSTATUS(status)) {
+				std::sort(run->nanos, run->nanos + depth);
+				printf("%6zu %10zu %9.1f%% %10.0f %10.0f %10.0f %10.0f %11zuK\n", depth, mustLeave, 100.0 * run->fallbacks / depth,
+					percentile(run->nanos, depth, 0.5), percentile(run->nanos, depth, 0.99), percentile(run->nanos, depth, 0.999),
+					run->nanos[depth - 1], run->highWater / 1024);
+			} else {
+				printf("%6zu %10zu %9.1f%% overflow at level %zu\n", depth, mustLeave, run->reached ? 100.0 * run->fallbacks / run->reached : 0.0, run->reached);
+			}
+
+			munmap(shared, sharedBytes);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,108 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+
+/* Full-copy enumeration (what FastEnumerator does) versus StreamEnumerator over a stand-in for
+** OBArray, a plain C++ collection with a getObjects:inRange: style bulk accessor. Measures the
+** time to the first callback and the total time for searches stopping at different depths.
+** Build: g++ -O2 -std=c++17 -I.. streaming.cpp -o streaming
+** Usage: streaming [elements, default 1000000] [runs, default 20] */
+
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include "stackenumerator.h"
+
+/* Stand-in for OBArray: owns object pointers and hands out copies of ranges */
+class ObjectArray
+{
+public:
+	explicit ObjectArray(size_t count) : _objects(count) {
+		for (size_t i = 0; i < count; i++)
+			_objects[i] = reinterpret_cast<void *>(uintptr_t(i + 1) * 16);
+	}
+	size_t count() const { return _objects.size(); }
+	void getObjects(void **into, size_t location, size_t length) const { memcpy(into, &_objects[location], length * sizeof(void *)); }
+
+private:
+	std::vector<void *> _objects;
+};
+
+struct ObjectArraySource
+{
+	const ObjectArray &array;
+
+	size_t count() const { return array.count(); }
+	void copy(void **into, size_t location, size_t length) const { array.getObjects(into, location, length); }
+};
+
+typedef std::chrono::steady_clock benchclock;
+
+static double micros(benchclock::time_point from, benchclock::time_point to)
+{
+	return std::chrono::duration<double, std::micro>(to - from).count();
+}
+
+// The FastEnumerator algorithm: snapshot everything into one StackVector, then whileEach
+static void fullCopy(const ObjectArray &array, size_t stopAt, double &first, double &total)
+{
+	const benchclock::time_point t0 = benchclock::now();
+	benchclock::time_point t1 = t0;
+	StackVector<void *> snapshot(array.count(), 32 * 1024, false);
+	array.getObjects(&snapshot[0], 0, array.count());
+	snapshot.whileEach([&](void *&object, size_t index) {
+		if (0 == index)
+			t1 = benchclock::now();
+		asm volatile("" : : "r"(object));
+		return index < stopAt;
+	});
+	first += micros(t0, t1);
+	total += micros(t0, benchclock::now());
+}
+
+static void streamed(const ObjectArray &array, size_t stopAt, double &first, double &total)
+{
+	const benchclock::time_point t0 = benchclock::now();
+	benchclock::time_point t1 = t0;
+	StreamEnumerator<void *> objects(ObjectArraySource{ array }, [&](void *&object, size_t index) {
+		if (0 == index)
+			t1 = benchclock::now();
+		asm volatile("" : : "r"(object));
+		return index < stopAt;
+	});
+	first += micros(t0, t1);
+	total += micros(t0, benchclock::now());
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t elements = argc > 1 ? size_t(atol(argv[1])) : 1000000;
+	const int runs = argc > 2 ? atoi(argv[2]) : 20;
+	const ObjectArray array(elements);
+	const size_t stops[] = { 0, elements / 100, elements / 2, elements };
+
+	printf("%10s %16s %14s %16s %14s\n", "stop at", "full first(us)", "full total", "stream first(us)", "stream total");
+
+	for (size_t stopAt : stops) {
+		double fullFirst = 0, fullTotal = 0, streamFirst = 0, streamTotal = 0;
+		for (int run = 0; run < runs; run++) {
+			fullCopy(array, stopAt, fullFirst, fullTotal);
+			streamed(array, stopAt, streamFirst, streamTotal);
+		}
+		printf("%10zu %16.2f %14.2f %16.2f %14.2f\n", stopAt, fullFirst / runs, fullTotal / runs, streamFirst / runs, streamTotal / runs);
+	}
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+
+/* Snapshot copy versus in-place enumeration of a std::vector (contiguous) and a std::deque
+** (not contiguous, so StableSource still falls back to the copy).
+** Build: g++ -O2 -std=c++17 -I.. zerocopy.cpp -o zerocopy
+** Usage: zerocopy [runs, default 200] */
+
+#include <chrono>
+#include <deque>
+#include <vector>
+#include "stackvector.h"
+
+typedef std::chrono::steady_clock benchclock;
+
+template <typename Enumerate> static double measure(const int runs, Enumerate enumerate)
+{
+	const benchclock::time_point t0 = benchclock::now();
+	for (int run = 0; run < runs; run++)
+		enumerate();
+	return std::chrono::duration<double, std::micro>(benchclock::now() - t0).count() / runs;
+}
+
+int main(int argc, char *argv[])
+{
+	const int runs = argc > 1 ? atoi(argv[1]) : 200;
+	const size_t sizes[] = { 1024, 64 * 1024, 1024 * 1024 };
+
+	printf("%10s %16s %16s %16s %16s\n", "elements", "vector copy(us)", "vector direct", "deque copy", "deque stable");
+
+	for (size_t elements : sizes) {
+		std::vector<long> vector(elements);
+		for (size_t i = 0; i < elements; i++)
+			vector[i] = long(i);
+		std::deque<long> deque(vector.begin(), vector.end());
+		long sum = 0;
+
+		const double vectorCopy = measure(runs, [&]() {
+			SnapshotEnumerator<long> each(vector, [&sum](long &member, size_t) { sum += member; });
+		});
+		const double vectorDirect = measure(runs, [&]() {
+			SnapshotEnumerator<long> each(StableSource(), vector, [&sum](const long &member, size_t) { sum += member; });
+		});
+		const double dequeCopy = measure(runs, [&]() {
+			SnapshotEnumerator<long> each(deque, [&sum](long &member, size_t) { sum += member; });
+		});
+		const double dequeStable = measure(runs, [&]() {
+			SnapshotEnumerator<long> each(StableSource(), deque, [&sum](const long &member, size_t) { sum += member; });
+		});
+
+		printf("%10zu %16.2f %16.2f %16.2f %16.2f (checksum %ld)\n", elements, vectorCopy, vectorDirect, dequeCopy, dequeStable, sum);
+	}
+
+	return 0;
+}
@@ -1,5 +1,51 @@
 #include <cstdio>
+#include <vector>
+#include <string>
 #include "stackvector.h"
+#include "stackmatrix.h"
+#include "stackpriorityqueue.h"
+#include "stackring.h"
+#include "stackpool.h"
+#include "stackarray.h"
+#include "stackscratch.h"
+#include "stackparallel.h"
+#include "stackscan.h"
+
+#if defined(__linux__)
+#include <ucontext.h>
+
+static ucontext_t mainContext, fiberContext;
+static const size_t fiberStackSize = 256 * 1024;
+static void *fiberStack;
+
+static void fiberMain()
+{
+	StackVector<int> small(1000);
+	StackVector<int> large(fiberStackSize / sizeof(int));
+	uintptr_t address = uintptr_t(&small[0]);
+
+	printf("fiber: small on stack %d inside fiber stack %d, large on stack %d\n", small.isAllocatedOnStack(),
+		address >= uintptr_t(fiberStack) && address < uintptr_t(fiberStack) + fiberStackSize, large.isAllocatedOnStack());
+	// returning resumes uc_link, after the vectors above are gone
+}
+
+static void runFiber(bool registerStack)
+{
+	getcontext(&fiberContext);
+	fiberContext.uc_stack.ss_sp = fiberStack;
+	fiberContext.uc_stack.ss_size = fiberStackSize;
+	fiberContext.uc_link = &mainContext;
+	makecontext(&fiberContext, fiberMain, 0);
+
+	if (registerStack) {
+		CustomStackScope scope(fiberStack, fiberStackSize);
+		swapcontext(&mainContext, &fiberContext);
+	}
+	else {
+		swapcontext(&mainContext, &fiberContext);
+	}
+}
+#endif
 
 unsigned long __stack = 64 * 1024;
 
@@ -15,6 +61,10 @@ size_t test::_cnt = 1;
 
 int main(void)
 {
+#if defined(STACKVECTOR_WATERMARK)
+	StackWatermarkScope watermark("main");
+#endif
+
 	StackVector<int> stack(10);
 
 	printf("stack is valid: %d\n", stack.isValid());
@@ -36,5 +86,135 @@ int main(void)
 
 	StackVector<test> stack3(100, 2048);
 
+	StackVector<test> lazy(100, 2048, true, StackVectorPrefault::None, true);
+
+	lazy.whileEach([](test& member, size_t index) {
+		return index < 2;
+	});
+
+	printf("lazy constructed %d of %d\n", lazy.constructedCount(), lazy.count());
+
+	StackMatrix<float> grid(3, 5, 16);
+	StackMatrix<float> flipped(5, 3);
+
+	grid.forEach([](float& member, size_t row, size_t column) {
+		member = row * 10 + column;
+	});
+
+	if (grid.transposeInto(flipped)) {
+		printf("grid stride %d, flipped(4,2) = %f\n", grid.stride(), flipped(4, 2));
+	}
+
+	StackVector<int> best(3);
+
+	if (topK(stack, best)) {
+		printf("top 3: %d %d %d\n", best[0], best[1], best[2]);
+	}
+
+	StackRing<int> window(4);
+
+	for (int i = 0; i < 10; i++) {
+		if (window.count() == window.capacity())
+			window.popFront();
+		window.pushBack(i);
+	}
+
+	printf("window front %d back %d promoted %d\n", window.front(), window.back(), window.isPromoted());
+
+	StackPool<test> nodes(8);
+
+	for (int i = 0; i < 12; i++) {
+		test *node = nodes.create();
+		if (i & 1)
+			nodes.destroy(node);
+	}
+
+	printf("pool live %d using heap %d\n", nodes.count(), nodes.isUsingHeap());
+
+	std::vector<int> numbers = { 3, 1, 4, 1, 5 };
+
+	SnapshotEnumerator<int> doubled(numbers, [&numbers](int& member, size_t index) {
+		numbers.push_back(member);
+	});
+
+	printf("numbers after snapshot enumeration %d\n", numbers.size());
+
+	const std::string word = "stackvector";
+	std::string middle;
+
+	SnapshotEnumerator<char> letters(word, 5, 3, [&middle](char& member, size_t index) {
+		middle += member;
+	});
+
+	printf("letters 5..7 of %s: %s\n", word.c_str(), middle.c_str());
+
+	StackVector<int> copied(numbers.begin(), numbers.end());
+	copied.assign(numbers.data(), numbers.data() + 2, copied.count() - 2);
+
+	printf("copied %d numbers, last %d\n", copied.count(), copied[copied.count() - 1]);
+
+	StackVectorView<int> adopted(numbers.data(), numbers.size());
+	adopted.forEach([](int& member, size_t index) {
+		member *= 2;
+	});
+
+	printf("numbers[0] through a view %d\n", numbers[0]);
+
+	// a reserve no stack can leave forces the heap; the malloc tier moves the strings to a smaller block
+	StackVector<std::string> names(1000, SIZE_MAX / 2);
+	names.forEach([](std::string& member, size_t index) {
+		member = "name " + std::to_string(index);
+	});
+	const bool namesShrank = names.shrink(10);
+
+	printf("names shrank %d to %d, last \"%s\"\n", namesShrank, names.count(), names[9].c_str());
+
+	// above STACKVECTOR_MMAP_THRESHOLD the block is mapped and the pages past the new size are unmapped
+	StackVector<int> samples(4 * 1024 * 1024, SIZE_MAX / 2, false);
+	const bool samplesMapped = samples.isMapped();
+	samples[1023] = 1023;
+	const bool samplesShrank = samples.shrink(1024);
+
+	printf("samples mapped %d shrank %d to %d, last %d\n", samplesMapped, samplesShrank, samples.count(), samples[1023]);
+
+	// large enough to be split over the shared pool's threads
+	StackVector<int> unsorted(4 * STACKPARALLEL_SORT_CUTOFF, 64 * 1024, false);
+	unsorted.forEach([](int& member, size_t index) {
+		member = int((index * 7919) % 100003);
+	});
+	parallelSort(unsorted);
+
+	printf("parallelSort of %d elements with %d threads: first %d last %d\n", unsorted.count(), int(StackTaskPool::shared().concurrency()),
+		unsorted[0], unsorted[unsorted.count() - 1]);
+
+	StackVector<int> bucketSizes(numbers.begin(), numbers.end());
+	const int bucketTotal = exclusiveScan(bucketSizes);
+
+	printf("bucket offsets end at %d, total %d\n", bucketSizes[bucketSizes.count() - 1], bucketTotal);
+
+#if defined(__linux__)
+	ScratchVector<int> scratch(100000);
+	printf("scratch in region %d, region used %d\n", scratch.isAllocatedInRegion(), int(ScratchRegion::current()->used()));
+#endif
+
+	StackBuffer<int, 16> fixed;
+	StackBuffer<int, 64 * 1024> fixedLarge;
+
+	fixed.forEach([](int& member, size_t index) {
+		member = index * index;
+	});
+
+	printf("fixed[15] = %d, large buffer valid %d on stack %d\n", fixed[15], fixedLarge.isValid(), fixedLarge.isAllocatedOnStack());
+
+#if defined(__linux__)
+	fiberStack = malloc(fiberStackSize);
+	runFiber(false);
+	runFiber(true);
+	free(fiberStack);
+
+	StackVector<int> afterFiber(10);
+	printf("after fiber: on stack %d\n", afterFiber.isAllocatedOnStack());
+#endif
+
 	return 0;
 }
@@ -0,0 +1,107 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <type_traits>
+#include "stackvector.h"
+
+/* Largest StackArray (in bytes) StackBuffer picks before switching to a probed StackVector */
+#ifndef STACKARRAY_MAX_BYTES
+#define STACKARRAY_MAX_BYTES (4 * 1024)
+#endif
+
+/* StackVector with a compile-time size: the elements are a plain member array, so there is no
+** stack probe, alloca or heap fallback, just the same forEach/whileEach/operator[] surface.
+** Elements are value-initialised, as StackVector constructs them by default. Only meant for
+** small N, the array lives wherever the object does. */
+
+template <typename T, size_t N> class StackArray
+{
+public:
+	StackArray() = default;
+	~StackArray() = default;
+
+	constexpr size_t count() const { return N; }
+	constexpr bool isValid() const { return N > 0; }
+	bool isAllocatedOnStack() const { return StackProbe::isStackAddress(_elements); }
+
+	void forEach(std::function<void(T& member, size_t index)>&& onEach) {
+		for (size_t idx = 0; idx < N; idx++) {
+			onEach(_elements[idx], idx);
+		}
+	}
+
+	void forEach(std::function<void(const T& member, size_t index)>&& onEach) const {
+		for (size_t idx = 0; idx < N; idx++) {
+			onEach(_elements[idx], idx);
+		}
+	}
+
+	void whileEach(std::function<bool(T& member, size_t index)>&& onEach) {
+		for (size_t idx = 0; idx < N; idx++) {
+			if (!onEach(_elements[idx], idx))
+				break;
+		}
+	}
+
+	void whileEach(std::function<bool(const T& member, size_t index)>&& onEach) const {
+		for (size_t idx = 0; idx < N; idx++) {
+			if (!onEach(_elements[idx], idx))
+				break;
+		}
+	}
+
+	T& operator[](size_t index) {
+#ifdef STACKVECTORDEBUG
+		if (index >= N)
+		{
+			SVOUT("%s: Access at %d outside of size %d\n", __PRETTY_FUNCTION__, index, N);
+		}
+#endif
+		return _elements[index];
+	}
+
+	T const & operator[] (size_t index) const {
+#ifdef STACKVECTORDEBUG
+		if (index >= N)
+		{
+			SVOUT("%s: Access at %d outside of size %d\n", __PRETTY_FUNCTION__, index, N);
+		}
+#endif
+		return _elements[index];
+	}
+
+protected:
+	T _elements[N > 0 ? N : 1] {};
+};
+
+/* StackVector whose size is fixed at compile time, default constructible like StackArray */
+
+template <typename T, size_t N> class FixedStackVector : public StackVector<T>
+{
+public:
+	/* MUST be inlined or alloca() would fail to survive past this method */
+	__attribute__((always_inline)) FixedStackVector(STACKVECTOR_PROFILE_WHERE_ONLY) : StackVector<T>(N, (16 * 1024), true, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS) { }
+};
+
+/*
+** Picks the storage for a compile-time sized temporary: StackArray up to STACKARRAY_MAX_BYTES,
+** a probed FixedStackVector (stack if there's room, heap otherwise) above that.
+** Example:
+**  StackBuffer<OBString*, 16> names;       // StackArray, no probe
+**  StackBuffer<double, 64 * 1024> samples; // FixedStackVector
+*/
+
+template <typename T, size_t N> using StackBuffer = typename std::conditional<(N * sizeof(T) <= STACKARRAY_MAX_BYTES), StackArray<T, N>, FixedStackVector<T, N>>::type;
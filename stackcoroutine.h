@@ -0,0 +1,184 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <cstddef>
+#include "stackvector.h"
+
+/* A StackVector can't live across a co_await: its alloca'd memory belongs to whichever stack
+** resumed the coroutine last. CoroutineVector takes its storage from an arena that is allocated
+** together with the coroutine frame instead, so it stays put while the coroutine is suspended.
+** The promise type opts in by deriving from CoroutineArenaPromise:
+**  struct Handler {
+**    struct promise_type : CoroutineArenaPromise<32 * 1024> { ... };
+**  };
+**  Handler handle(Connection *c) {
+**    CoroutineArena &arena = co_await CoroutineArena::current();
+**    CoroutineVector<char> buffer(4096, arena);
+**    co_await c->read(&buffer[0], buffer.count());
+**  }
+** The arena is a LIFO bump allocator; requests that don't fit fall back to the heap. */
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+
+class CoroutineArena
+{
+public:
+	CoroutineArena(void *memory, const size_t size)
+		: _base(static_cast<unsigned char *>(memory)), _top(_base), _end(_base + size)
+	{
+	}
+
+	CoroutineArena() = delete;
+	CoroutineArena(const CoroutineArena&) = delete;
+	CoroutineArena& operator=(const CoroutineArena&) = delete;
+
+	// Returns nullptr if there is no room left
+	void *allocate(const size_t bytes, const size_t alignment)
+	{
+		unsigned char *memory = reinterpret_cast<unsigned char *>((uintptr_t(_top) + alignment - 1) & ~uintptr_t(alignment - 1));
+		if (memory > _end || size_t(_end - memory) < bytes)
+			return nullptr;
+		_top = memory + bytes;
+		return memory;
+	}
+
+	// Only the most recent allocation is actually reclaimed, anything else is until the frame dies
+	void release(void *memory, const size_t bytes)
+	{
+		if (static_cast<unsigned char *>(memory) + bytes == _top)
+			_top = static_cast<unsigned char *>(memory);
+	}
+
+	bool owns(const void *memory) const { return memory >= _base && memory < _end; }
+	size_t available() const { return _end - _top; }
+
+	// co_await CoroutineArena::current() yields the arena of the calling coroutine without suspending
+	struct Current
+	{
+		CoroutineArena *arena = nullptr;
+
+		bool await_ready() const noexcept { return false; }
+		template <typename P> bool await_suspend(std::coroutine_handle<P> handle) noexcept {
+			arena = &handle.promise().arena();
+			return false;
+		}
+		CoroutineArena &await_resume() const noexcept { return *arena; }
+	};
+
+	static Current current() { return Current(); }
+
+	// Used by CoroutineArenaPromise to hand the space behind a new frame over to its promise
+	static void *&pending()
+	{
+		static thread_local void *memory = nullptr;
+		return memory;
+	}
+
+protected:
+	unsigned char *_base;
+	unsigned char *_top;
+	unsigned char *_end;
+};
+
+/* Base for promise types: allocates ArenaBytes behind every coroutine frame */
+
+template <size_t ArenaBytes = (16 * 1024)> class CoroutineArenaPromise
+{
+public:
+	static void *operator new(const size_t frameSize)
+	{
+		const size_t frameBytes = roundedFrame(frameSize);
+		unsigned char *memory = static_cast<unsigned char *>(::operator new(frameBytes + ArenaBytes));
+		CoroutineArena::pending() = memory + frameBytes;
+		SVOUT("%s: frame %p size %d arena %p\n", __PRETTY_FUNCTION__, memory, int(frameSize), memory + frameBytes);
+		return memory;
+	}
+
+	static void operator delete(void *frame)
+	{
+		::operator delete(frame);
+	}
+
+	// The frame is normally allocated right before the promise is constructed, on the same thread.
+	// If it wasn't allocated by operator new above (elided, or a derived operator new), there is
+	// no space behind it and the arena goes on the heap instead.
+	CoroutineArenaPromise()
+		: _heapArena(CoroutineArena::pending() ? nullptr : ::operator new(ArenaBytes))
+		, _arena(_heapArena ? _heapArena : CoroutineArena::pending(), ArenaBytes)
+	{
+		CoroutineArena::pending() = nullptr;
+	}
+
+	~CoroutineArenaPromise()
+	{
+		::operator delete(_heapArena);
+	}
+
+	CoroutineArenaPromise(const CoroutineArenaPromise&) = delete;
+	CoroutineArenaPromise& operator=(const CoroutineArenaPromise&) = delete;
+
+	CoroutineArena &arena() { return _arena; }
+
+protected:
+	static size_t roundedFrame(const size_t frameSize)
+	{
+		const size_t alignment = alignof(std::max_align_t);
+		return (frameSize + alignment - 1) & ~(alignment - 1);
+	}
+
+	void          *_heapArena;
+	CoroutineArena _arena;
+};
+
+/* StackVector whose storage comes from a coroutine's arena, or the heap if it doesn't fit */
+
+template <typename T> class CoroutineVector : public StackVector<T>
+{
+public:
+	CoroutineVector(const size_t size, CoroutineArena &arena, bool callConstructorsDestructors = true)
+		: CoroutineVector(size, arena, arena.allocate(size * sizeof(T), alignof(T)), callConstructorsDestructors)
+	{
+	}
+
+	CoroutineVector() = delete;
+	CoroutineVector(const CoroutineVector&) = delete;
+	CoroutineVector& operator=(const CoroutineVector&) = delete;
+
+	~CoroutineVector()
+	{
+		if (_inArena) {
+			StackVector<T>::destroyFrom(0);
+			_arena.release(StackVector<T>::_memory, StackVector<T>::_size * sizeof(T));
+		}
+	}
+
+	// True if the storage lives in the coroutine's arena
+	bool isAllocatedInArena() const { return _inArena; }
+
+protected:
+	CoroutineVector(const size_t size, CoroutineArena &arena, void *memory, bool callConstructorsDestructors)
+		: StackVector<T>(static_cast<T*>(memory ? memory : malloc(size * sizeof(T))), size, callConstructorsDestructors, nullptr == memory)
+		, _arena(arena), _inArena(nullptr != memory)
+	{
+		SVOUT("%s: allocated %p in arena %d\n", __PRETTY_FUNCTION__, StackVector<T>::_memory, _inArena);
+	}
+
+	CoroutineArena &_arena;
+	bool            _inArena;
+};
+
+#endif
@@ -0,0 +1,83 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <algorithm>
+#include "stackvector.h"
+
+/*
+** Streaming variant of FastEnumerator: rather than copying the whole collection up front, it
+** fetches WindowSize elements at a time into one reusable window (on stack whenever possible)
+** and stops fetching as soon as the callback returns false. The first callback runs after
+** copying at most one window and memory use no longer depends on the collection size.
+** Unlike FastEnumerator this is NOT a snapshot: changes made to the source while enumerating
+** show up in chunks that haven't been fetched yet. The source's count is re-checked per chunk,
+** and a range reaching past it ends there. Node based containers (std::list, std::set, ...)
+** are walked from begin() for every chunk since the callback may have changed them, so long
+** ones want a larger WindowSize, or SnapshotEnumerator which walks them once.
+** Sources are the same as for SnapshotEnumerator, see stackvector.h.
+** Example:
+**  StreamEnumerator<OBString*> strings(OBArraySource<OBString*>{ array }, [](OBString* &string, size_t index) {
+**    return ![string isEqualToString:@"needle"];
+**  });
+*/
+
+template <typename O, size_t WindowSize = 256> class StreamEnumerator : protected StackVector<O>
+{
+public:
+	template <typename Source> __attribute__((always_inline)) StreamEnumerator(const Source &source, std::function<bool(O& member, size_t index)> && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: StackVector<O>(std::min(WindowSize, EnumerationSource<Source, O>::adapt(source).count()), 32 * 1024, !std::is_trivial<O>::value, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS) {
+		stream(EnumerationSource<Source, O>::adapt(source), 0, EnumerationSource<Source, O>::adapt(source).count(), enumCallback);
+	};
+	// Enumerates [location, location + length), indexes passed to the callback start at 0
+	template <typename Source> __attribute__((always_inline)) StreamEnumerator(const Source &source, size_t location, size_t length, std::function<bool(O& member, size_t index)> && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: StackVector<O>(std::min(WindowSize, enumerationLength(EnumerationSource<Source, O>::adapt(source).count(), location, length)), 32 * 1024, !std::is_trivial<O>::value, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS) {
+		stream(EnumerationSource<Source, O>::adapt(source), location, length, enumCallback);
+	};
+	StreamEnumerator() = delete;
+	~StreamEnumerator() = default;
+
+	// Number of elements fetched from the source, at most one window more than were enumerated
+	size_t fetchedCount() const { return _fetched; }
+
+protected:
+	template <typename Adapter> void stream(const Adapter &source, const size_t location, const size_t length, std::function<bool(O& member, size_t index)> &enumCallback) {
+		O *window = StackVector<O>::_memory;
+		const size_t windowSize = StackVector<O>::_size;
+		_fetched = 0;
+
+		if (!window || 0 == windowSize)
+			return;
+
+		for (size_t offset = 0; offset < length; ) {
+			const size_t available = source.count();
+			if (location + offset >= available)
+				break;
+
+			const size_t chunk = std::min(std::min(windowSize, length - offset), available - (location + offset));
+			source.copy(window, location + offset, chunk);
+			_fetched += chunk;
+
+			for (size_t idx = 0; idx < chunk; idx++) {
+				if (!enumCallback(window[idx], offset + idx))
+					return;
+			}
+
+			offset += chunk;
+		}
+	}
+
+	size_t _fetched;
+};
@@ -0,0 +1,195 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include "stackvector.h"
+
+/* Bytes of cache a single tile (source and destination together) should fit into */
+#ifndef STACKMATRIX_TILEBYTES
+#define STACKMATRIX_TILEBYTES (16 * 1024)
+#endif
+
+/* Temporary rows x columns grid for image and layout scratch work. Storage comes from the
+** same stack-or-heap decision as StackVector, so the constructor MUST be inlined as well.
+** If rowAlignment (in bytes, a power of two and a multiple of sizeof(T)) is given, every
+** row is padded so that it starts on such a boundary; stride() is then >= columns(). */
+
+template <typename T> class StackMatrix : protected StackVector<T>
+{
+public:
+	__attribute__((always_inline)) StackMatrix(const size_t rows, const size_t columns, const size_t rowAlignment = 0, const size_t mustLeaveStackSizeForScope = (16 * 1024), bool callConstructorsDestructors = true STACKVECTOR_PROFILE_WHERE)
+		: StackVector<T>(storageSize(rows, columns, rowAlignment), mustLeaveStackSizeForScope, callConstructorsDestructors, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS)
+		, _origin(StackVector<T>::_memory), _rows(rows), _columns(columns), _stride(rowStride(columns, rowAlignment))
+	{
+		if (_origin && usableAlignment(rowAlignment)) {
+			// round up to the first aligned row start, storageSize() reserved the slack
+			const uintptr_t aligned = (uintptr_t(_origin) + rowAlignment - 1) & ~uintptr_t(rowAlignment - 1);
+			if (0 == (aligned - uintptr_t(_origin)) % sizeof(T))
+				_origin = reinterpret_cast<T *>(aligned);
+		}
+	}
+
+	StackMatrix() = delete;
+	StackMatrix(const StackMatrix&) = delete;
+	StackMatrix& operator=(const StackMatrix&) = delete;
+	~StackMatrix() = default;
+
+	size_t rows() const { return _rows; }
+	size_t columns() const { return _columns; }
+	// Distance between two consecutive rows, in elements
+	size_t stride() const { return _stride; }
+	bool isValid() const { return _origin != nullptr && _rows > 0 && _columns > 0; }
+
+	using StackVector<T>::isAllocatedOnStack;
+
+	T& operator()(size_t row, size_t column) {
+#ifdef STACKVECTORDEBUG
+		if (row >= _rows || column >= _columns)
+		{
+			SVOUT("%s: Access at %d,%d outside of size %d,%d\n", __PRETTY_FUNCTION__, row, column, _rows, _columns);
+		}
+#endif
+		return _origin[row * _stride + column];
+	}
+
+	T const & operator()(size_t row, size_t column) const {
+#ifdef STACKVECTORDEBUG
+		if (row >= _rows || column >= _columns)
+		{
+			SVOUT("%s: Access at %d,%d outside of size %d,%d\n", __PRETTY_FUNCTION__, row, column, _rows, _columns);
+		}
+#endif
+		return _origin[row * _stride + column];
+	}
+
+	// Row as a contiguous span of columns() elements, padding excluded
+	StackSpan<T> row(size_t row) { return StackSpan<T>{ _origin + row * _stride, _columns }; }
+	StackSpan<const T> row(size_t row) const { return StackSpan<const T>{ _origin + row * _stride, _columns }; }
+
+	// Iterates in plain row-major order
+	void forEach(std::function<void(T& member, size_t row, size_t column)>&& onEach) {
+		if (_origin) {
+			for (size_t r = 0; r < _rows; r++) {
+				T *line = _origin + r * _stride;
+				for (size_t c = 0; c < _columns; c++)
+					onEach(line[c], r, c);
+			}
+		}
+	}
+
+	void forEach(std::function<void(const T& member, size_t row, size_t column)>&& onEach) const {
+		if (_origin) {
+			for (size_t r = 0; r < _rows; r++) {
+				const T *line = _origin + r * _stride;
+				for (size_t c = 0; c < _columns; c++)
+					onEach(line[c], r, c);
+			}
+		}
+	}
+
+	// Iterates tile by tile, each tile walked row-major; 0 picks a tile edge that fits STACKMATRIX_TILEBYTES
+	void tiledForEach(std::function<void(T& member, size_t row, size_t column)>&& onEach, size_t tileRows = 0, size_t tileColumns = 0) {
+		if (0 == tileRows) tileRows = tileEdge();
+		if (0 == tileColumns) tileColumns = tileEdge();
+
+		if (_origin) {
+			for (size_t tr = 0; tr < _rows; tr += tileRows) {
+				const size_t rowEnd = std::min(tr + tileRows, _rows);
+				for (size_t tc = 0; tc < _columns; tc += tileColumns) {
+					const size_t columnEnd = std::min(tc + tileColumns, _columns);
+					for (size_t r = tr; r < rowEnd; r++) {
+						T *line = _origin + r * _stride;
+						for (size_t c = tc; c < columnEnd; c++)
+							onEach(line[c], r, c);
+					}
+				}
+			}
+		}
+	}
+
+	void tiledForEach(std::function<void(const T& member, size_t row, size_t column)>&& onEach, size_t tileRows = 0, size_t tileColumns = 0) const {
+		if (0 == tileRows) tileRows = tileEdge();
+		if (0 == tileColumns) tileColumns = tileEdge();
+
+		if (_origin) {
+			for (size_t tr = 0; tr < _rows; tr += tileRows) {
+				const size_t rowEnd = std::min(tr + tileRows, _rows);
+				for (size_t tc = 0; tc < _columns; tc += tileColumns) {
+					const size_t columnEnd = std::min(tc + tileColumns, _columns);
+					for (size_t r = tr; r < rowEnd; r++) {
+						const T *line = _origin + r * _stride;
+						for (size_t c = tc; c < columnEnd; c++)
+							onEach(line[c], r, c);
+					}
+				}
+			}
+		}
+	}
+
+	// Cache-blocked transpose; target must be columns() x rows(). Returns false on size mismatch
+	bool transposeInto(StackMatrix<T>& target, size_t edge = 0) const {
+		if (!isValid() || !target.isValid() || target._rows != _columns || target._columns != _rows)
+			return false;
+
+		if (0 == edge) edge = tileEdge();
+
+		for (size_t tr = 0; tr < _rows; tr += edge) {
+			const size_t rowEnd = std::min(tr + edge, _rows);
+			for (size_t tc = 0; tc < _columns; tc += edge) {
+				const size_t columnEnd = std::min(tc + edge, _columns);
+				for (size_t r = tr; r < rowEnd; r++) {
+					const T *line = _origin + r * _stride;
+					for (size_t c = tc; c < columnEnd; c++)
+						target._origin[c * target._stride + r] = line[c];
+				}
+			}
+		}
+
+		return true;
+	}
+
+	// Largest power of two edge so that a source and a destination tile fit STACKMATRIX_TILEBYTES
+	static size_t tileEdge() {
+		size_t edge = 1;
+		while ((edge * 2) * (edge * 2) * sizeof(T) * 2 <= STACKMATRIX_TILEBYTES)
+			edge *= 2;
+		return edge;
+	}
+
+protected:
+	static bool usableAlignment(const size_t rowAlignment) {
+		return rowAlignment > sizeof(T) && 0 == (rowAlignment & (rowAlignment - 1)) && 0 == (rowAlignment % sizeof(T));
+	}
+
+	static size_t rowStride(const size_t columns, const size_t rowAlignment) {
+		if (!usableAlignment(rowAlignment))
+			return columns;
+		const size_t perAlignment = rowAlignment / sizeof(T);
+		return ((columns + perAlignment - 1) / perAlignment) * perAlignment;
+	}
+
+	static size_t storageSize(const size_t rows, const size_t columns, const size_t rowAlignment) {
+		if (!usableAlignment(rowAlignment))
+			return rows * columns;
+		return rows * rowStride(columns, rowAlignment) + rowAlignment / sizeof(T);
+	}
+
+	T       *_origin;
+	size_t   _rows;
+	size_t   _columns;
+	size_t   _stride;
+};
@@ -0,0 +1,302 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include "stackvector.h"
+/* Whether StackTaskPool starts worker threads at all; without them every job runs on the caller */
+#ifndef STACKPARALLEL_THREADS
+#if defined(__linux__)
+#define STACKPARALLEL_THREADS 1
+#else
+#define STACKPARALLEL_THREADS 0
+#endif
+#endif
+
+#if STACKPARALLEL_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+/* Vectors shorter than this are sorted serially, splitting them costs more than it gains */
+#ifndef STACKPARALLEL_SORT_CUTOFF
+#define STACKPARALLEL_SORT_CUTOFF (32 * 1024)
+#endif
+
+/* Minimal fork-join pool for the parallel algorithms: run() spreads job(0) .. job(count - 1)
+** over the workers and the calling thread and returns once all of them are done. One run() at
+** a time; a run() issued from inside a job executes serially instead of deadlocking. */
+
+class StackTaskPool
+{
+public:
+	// 0 uses one thread per hardware thread, the caller included
+	StackTaskPool(size_t threads = 0) : _count(0), _active(0), _job(nullptr), _generation(0), _stopping(false)
+	{
+#if STACKPARALLEL_THREADS
+		if (0 == threads)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		for (size_t i = 1; i < threads; i++)
+			_workers.emplace_back([this]() { work(); });
+#else
+		(void)threads;
+#endif
+	}
+
+	~StackTaskPool()
+	{
+#if STACKPARALLEL_THREADS
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_wake.notify_all();
+		for (std::thread &worker : _workers)
+			worker.join();
+#endif
+	}
+
+	StackTaskPool(const StackTaskPool&) = delete;
+	StackTaskPool& operator=(const StackTaskPool&) = delete;
+
+	// Threads taking part in run(), the caller included
+	size_t concurrency() const
+	{
+#if STACKPARALLEL_THREADS
+		return _workers.size() + 1;
+#else
+		return 1;
+#endif
+	}
+
+	void run(const size_t count, const std::function<void(size_t index)> &job)
+	{
+#if STACKPARALLEL_THREADS
+		if (count > 1 && !_workers.empty() && !insideJob())
+		{
+			std::lock_guard<std::mutex> running(_runMutex);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_job = &job;
+				_count = count;
+				_active = 0;
+				_next.store(0);
+				_pending.store(count);
+				_generation++;
+			}
+			_wake.notify_all();
+
+			take(job, count);
+
+			// no worker may still be inside take() when the next run() resets the counters
+			std::unique_lock<std::mutex> lock(_mutex);
+			_job = nullptr;
+			_done.wait(lock, [this]() { return 0 == _pending.load() && 0 == _active; });
+			return;
+		}
+#endif
+		for (size_t index = 0; index < count; index++)
+			job(index);
+	}
+
+	// Process wide pool, created on first use
+	static StackTaskPool &shared()
+	{
+		static StackTaskPool pool;
+		return pool;
+	}
+
+protected:
+#if STACKPARALLEL_THREADS
+	static bool &insideJob()
+	{
+		static thread_local bool inside = false;
+		return inside;
+	}
+
+	void take(const std::function<void(size_t index)> &job, const size_t count)
+	{
+		insideJob() = true;
+		for (size_t index = _next.fetch_add(1); index < count; index = _next.fetch_add(1)) {
+			job(index);
+			if (1 == _pending.fetch_sub(1)) {
+				std::lock_guard<std::mutex> lock(_mutex);
+				_done.notify_all();
+			}
+		}
+		insideJob() = false;
+	}
+
+	void work()
+	{
+		size_t seen = 0;
+		for (;;) {
+			const std::function<void(size_t index)> *job;
+			size_t count;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_wake.wait(lock, [this, seen]() { return _stopping || _generation != seen; });
+				if (_stopping)
+					return;
+				seen = _generation;
+				job = _job;
+				count = _count;
+				if (job)
+					_active++;
+			}
+			if (job) {
+				take(*job, count);
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (0 == --_active)
+					_done.notify_all();
+			}
+		}
+	}
+
+	std::vector<std::thread>  _workers;
+	std::mutex                _runMutex;
+	std::mutex                _mutex;
+	std::condition_variable   _wake;
+	std::condition_variable   _done;
+	std::atomic<size_t>       _next;
+	std::atomic<size_t>       _pending;
+#endif
+	size_t                                     _count;
+	size_t                                     _active;
+	const std::function<void(size_t index)>   *_job;
+	size_t                                     _generation;
+	bool                                       _stopping;
+};
+
+/* Position in the stable merge of a[0, aCount) and b[0, bCount) (a first on ties): returns how
+** many elements of a precede output position k, the rest come from b */
+template <typename T, typename Compare> size_t stackMergeSplit(const T *a, const size_t aCount, const T *b, const size_t bCount, const size_t k, Compare &compare)
+{
+	size_t low = k > bCount ? k - bCount : 0;
+	size_t high = k < aCount ? k : aCount;
+	while (low < high) {
+		const size_t i = low + (high - low) / 2;
+		if (!compare(b[k - i - 1], a[i]))
+			low = i + 1;
+		else
+			high = i;
+	}
+	return low;
+}
+
+/* The pair of sorted runs that a merge round of the given width writes position from: its
+** output is [start, end), the two inputs [start, middle) and [middle, end). Returns false if
+** position is where the pair starts, or count, where no split needs to be searched for */
+inline bool stackMergePair(const size_t position, const size_t count, const size_t chunks, const size_t width, size_t &start, size_t &middle, size_t &end)
+{
+	if (position >= count)
+		return false;
+
+	// the run holding position; the division can land one run early because of rounding
+	size_t run = position * chunks / count;
+	while (count * (run + 1) / chunks <= position)
+		run++;
+
+	const size_t pair = run / (2 * width);
+	start = count * std::min(chunks, pair * 2 * width) / chunks;
+	middle = count * std::min(chunks, pair * 2 * width + width) / chunks;
+	end = count * std::min(chunks, (pair + 1) * 2 * width) / chunks;
+	return position != start;
+}
+
+/* Sorts vector with up to pool.concurrency() threads: equal chunks are std::sort()ed in
+** parallel, then merged pairwise, every round split evenly over the threads by output position
+** so duplicates or skewed input don't serialise it. The merge buffer comes from the same
+** stack-or-heap decision as any StackVector, which is why this MUST be inlined. Below cutoff
+** elements, or with a single thread, it is a plain std::sort(). Not stable. */
+
+template <typename T, typename Compare = std::less<T>> __attribute__((always_inline)) inline void parallelSort(StackVector<T> &vector, Compare compare = Compare(), StackTaskPool &pool = StackTaskPool::shared(), const size_t cutoff = STACKPARALLEL_SORT_CUTOFF)
+{
+	const size_t count = vector.count();
+	if (count < 2 || !vector.isValid())
+		return;
+
+	// reaching the last element first constructs everything a lazy vector still owes
+	vector[count - 1];
+	T *data = &vector[0];
+
+	const size_t threads = pool.concurrency();
+	if (count < cutoff || threads < 2) {
+		std::sort(data, data + count, compare);
+		return;
+	}
+
+	StackVector<T> buffer(count, 16 * 1024, !std::is_trivial<T>::value);
+	if (!buffer.isValid()) {
+		std::sort(data, data + count, compare);
+		return;
+	}
+
+	const size_t chunks = threads;
+	pool.run(chunks, [data, count, chunks, &compare](size_t chunk) {
+		std::sort(data + count * chunk / chunks, data + count * (chunk + 1) / chunks, compare);
+	});
+
+	// sorted runs are [count * r / chunks, count * (r + 1) / chunks); every round doubles their width.
+	// Splits are all found before any merge starts, as merging moves elements out of the source
+	const size_t pieceSize = (count + threads - 1) / threads;
+	const size_t pieces = (count + pieceSize - 1) / pieceSize;
+	StackVector<size_t> splits(pieces + 1, 16 * 1024, false);
+	T *from = data;
+	T *to = &buffer[0];
+	for (size_t width = 1; width < chunks; width *= 2) {
+		size_t *split = &splits[0];
+
+		pool.run(pieces + 1, [=, &compare](size_t piece) {
+			const size_t position = std::min(count, piece * pieceSize);
+			size_t start = 0, middle = 0, end = 0;
+			if (stackMergePair(position, count, chunks, width, start, middle, end))
+				split[piece] = stackMergeSplit(from + start, middle - start, from + middle, end - middle, position - start, compare);
+		});
+
+		pool.run(pieces, [=, &compare](size_t piece) {
+			const size_t first = piece * pieceSize;
+			const size_t last = std::min(count, first + pieceSize);
+
+			// a piece may span several pairs of runs, merge each part separately
+			for (size_t position = first; position < last; ) {
+				size_t start = 0, middle = 0, end = 0;
+				stackMergePair(position, count, chunks, width, start, middle, end);
+				const size_t stop = std::min(last, end);
+
+				const size_t i0 = position == start ? 0 : split[piece];
+				const size_t i1 = stop == end ? middle - start : split[piece + 1];
+				std::merge(std::make_move_iterator(from + start + i0), std::make_move_iterator(from + start + i1),
+					std::make_move_iterator(from + middle + (position - start - i0)), std::make_move_iterator(from + middle + (stop - start - i1)),
+					to + position, compare);
+				position = stop;
+			}
+		});
+
+		std::swap(from, to);
+	}
+
+	if (from != data) {
+		pool.run(pieces, [=](size_t piece) {
+			const size_t first = piece * pieceSize;
+			std::move(from + first, from + std::min(count, first + pieceSize), data + first);
+		});
+	}
+}
@@ -0,0 +1,174 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include "stackvector.h"
+
+/* Scoped node allocator for algorithms that create and drop lots of small objects in one call
+** (expression trees, temporary graphs). Nodes are carved out of a block that uses the StackVector
+** stack-or-heap decision, recycled through an intrusive free list and, once the block is used up,
+** taken from heap chunks of growing size. Everything is released at scope exit; destructors of
+** nodes still alive at that point only run if T is not trivially destructible. */
+
+template <typename T> class StackPool
+{
+	struct FreeNode
+	{
+		FreeNode *next;
+	};
+
+public:
+	struct alignas(alignof(T) > alignof(FreeNode) ? alignof(T) : alignof(FreeNode)) Slot
+	{
+		unsigned char bytes[sizeof(T) > sizeof(FreeNode) ? sizeof(T) : sizeof(FreeNode)];
+	};
+
+	/* MUST be inlined or alloca() would fail to survive past this method */
+	__attribute__((always_inline)) StackPool(const size_t capacity, const size_t mustLeaveStackSizeForScope = (16 * 1024) STACKVECTOR_PROFILE_WHERE)
+		: _block(capacity, mustLeaveStackSizeForScope, false, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS), _blockUsed(0), _chunks(nullptr), _freeList(nullptr)
+		, _freeCount(0), _live(0), _nextChunkCapacity(capacity < 16 ? 16 : capacity)
+	{
+	}
+
+	StackPool() = delete;
+	StackPool(const StackPool&) = delete;
+	StackPool& operator=(const StackPool&) = delete;
+
+	~StackPool()
+	{
+		if (!std::is_trivially_destructible<T>::value && _live)
+			destroyLive();
+
+		while (_chunks)
+		{
+			Chunk *next = _chunks->next;
+			SVOUT("%s: freeing chunk %p..\n", __PRETTY_FUNCTION__, _chunks);
+			free(_chunks);
+			_chunks = next;
+		}
+	}
+
+	// Number of nodes currently handed out
+	size_t count() const { return _live; }
+	bool isValid() const { return _block.isValid() || _chunks != nullptr; }
+	// True once the initial block ran out and heap chunks were needed
+	bool isUsingHeap() const { return _chunks != nullptr; }
+
+	// Returns nullptr if the pool is exhausted and no heap chunk could be allocated
+	template <typename... Args> T* create(Args&&... args) {
+		void *slot = takeSlot();
+		if (!slot)
+			return nullptr;
+		_live++;
+		return new (slot) T (std::forward<Args>(args)...);
+	}
+
+	// Only pass nodes that came from create() of this very pool
+	void destroy(T *node) {
+		if (node) {
+			node->~T();
+			FreeNode *freed = new (static_cast<void*>(node)) FreeNode;
+			freed->next = _freeList;
+			_freeList = freed;
+			_freeCount++;
+			_live--;
+		}
+	}
+
+protected:
+	struct Chunk
+	{
+		Chunk   *next;
+		size_t   capacity;
+		size_t   used;
+
+		static size_t headerSize() { return ((sizeof(Chunk) + alignof(Slot) - 1) / alignof(Slot)) * alignof(Slot); }
+		Slot* slots() { return reinterpret_cast<Slot*>(reinterpret_cast<unsigned char*>(this) + headerSize()); }
+	};
+
+	void* takeSlot() {
+		if (_freeList) {
+			FreeNode *node = _freeList;
+			_freeList = node->next;
+			_freeCount--;
+			return node;
+		}
+
+		if (_blockUsed < _block.count() && _block.isValid())
+			return &_block[_blockUsed++];
+
+		if (!_chunks || _chunks->used == _chunks->capacity) {
+			Chunk *chunk = static_cast<Chunk*>(malloc(Chunk::headerSize() + _nextChunkCapacity * sizeof(Slot)));
+			if (!chunk)
+				return nullptr;
+			SVOUT("%s: allocated chunk %p for %d nodes\n", __PRETTY_FUNCTION__, chunk, _nextChunkCapacity);
+			chunk->next = _chunks;
+			chunk->capacity = _nextChunkCapacity;
+			chunk->used = 0;
+			_chunks = chunk;
+			_nextChunkCapacity *= 2;
+		}
+
+		return &_chunks->slots()[_chunks->used++];
+	}
+
+	// Runs ~T() on every handed out slot that is not on the free list
+	void destroyLive() {
+		StackVector<FreeNode*> freed(_freeCount, 4 * 1024, false);
+		const bool sorted = freed.isValid();
+
+		if (sorted) {
+			size_t idx = 0;
+			for (FreeNode *node = _freeList; node; node = node->next)
+				freed[idx++] = node;
+			std::sort(&freed[0], &freed[0] + _freeCount);
+		}
+
+		auto isFree = [&](Slot *slot) -> bool {
+			FreeNode *node = reinterpret_cast<FreeNode*>(slot);
+			if (sorted)
+				return std::binary_search(&freed[0], &freed[0] + _freeCount, node);
+			for (FreeNode *f = _freeList; f; f = f->next)
+				if (f == node)
+					return true;
+			return false;
+		};
+
+		for (size_t idx = 0; idx < _blockUsed; idx++) {
+			if (!isFree(&_block[idx]))
+				reinterpret_cast<T*>(&_block[idx])->~T();
+		}
+
+		for (Chunk *chunk = _chunks; chunk; chunk = chunk->next) {
+			for (size_t idx = 0; idx < chunk->used; idx++) {
+				if (!isFree(&chunk->slots()[idx]))
+					reinterpret_cast<T*>(&chunk->slots()[idx])->~T();
+			}
+		}
+
+		_live = 0;
+	}
+
+	StackVector<Slot>  _block;
+	size_t             _blockUsed;
+	Chunk             *_chunks;
+	FreeNode          *_freeList;
+	size_t             _freeCount;
+	size_t             _live;
+	size_t             _nextChunkCapacity;
+};
@@ -0,0 +1,150 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <algorithm>
+#include <utility>
+#include "stackvector.h"
+
+/* Fixed capacity binary heap with storage coming from the StackVector stack-or-heap decision.
+** Ordering follows std::priority_queue: top() is the element that Compare ranks highest.
+** Elements are only constructed when pushed and destroyed when popped (or on scope exit). */
+
+template <typename T, typename Compare = std::less<T>> class StackPriorityQueue : protected StackVector<T>
+{
+public:
+	/* MUST be inlined or alloca() would fail to survive past this method */
+	__attribute__((always_inline)) StackPriorityQueue(const size_t capacity, const size_t mustLeaveStackSizeForScope = (16 * 1024), Compare compare = Compare() STACKVECTOR_PROFILE_WHERE)
+		: StackVector<T>(capacity, mustLeaveStackSizeForScope, false, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS), _count(0), _compare(compare)
+	{
+	}
+
+	StackPriorityQueue() = delete;
+	StackPriorityQueue(const StackPriorityQueue&) = delete;
+	StackPriorityQueue& operator=(const StackPriorityQueue&) = delete;
+
+	~StackPriorityQueue()
+	{
+		clear();
+	}
+
+	size_t capacity() const { return StackVector<T>::_size; }
+	size_t count() const { return _count; }
+	bool isEmpty() const { return 0 == _count; }
+	bool isFull() const { return _count >= StackVector<T>::_size; }
+	bool isValid() const { return StackVector<T>::isValid(); }
+
+	using StackVector<T>::isAllocatedOnStack;
+
+	const T& top() const { return StackVector<T>::_memory[0]; }
+
+	// Returns false if the queue is already at capacity
+	bool push(const T& value) {
+		if (isFull() || !StackVector<T>::_memory)
+			return false;
+		new (&StackVector<T>::_memory[_count++]) T (value);
+		std::push_heap(StackVector<T>::_memory, StackVector<T>::_memory + _count, _compare);
+		return true;
+	}
+
+	bool push(T&& value) {
+		if (isFull() || !StackVector<T>::_memory)
+			return false;
+		new (&StackVector<T>::_memory[_count++]) T (std::move(value));
+		std::push_heap(StackVector<T>::_memory, StackVector<T>::_memory + _count, _compare);
+		return true;
+	}
+
+	// Bounded insert: once full, value replaces top() only if Compare ranks it lower.
+	// With std::greater this keeps the capacity() largest values seen so far.
+	bool offer(const T& value) {
+		if (!isFull())
+			return push(value);
+		if (0 == _count || !_compare(value, top()))
+			return false;
+		std::pop_heap(StackVector<T>::_memory, StackVector<T>::_memory + _count, _compare);
+		StackVector<T>::_memory[_count - 1] = value;
+		std::push_heap(StackVector<T>::_memory, StackVector<T>::_memory + _count, _compare);
+		return true;
+	}
+
+	void pop() {
+		if (_count) {
+			std::pop_heap(StackVector<T>::_memory, StackVector<T>::_memory + _count, _compare);
+			(&StackVector<T>::_memory[--_count])->~T();
+		}
+	}
+
+	void clear() {
+		while (_count)
+			(&StackVector<T>::_memory[--_count])->~T();
+	}
+
+	// Visits the elements in heap (not priority) order
+	void forEach(std::function<void(const T& member, size_t index)>&& onEach) const {
+		for (size_t idx = 0; idx < _count; idx++)
+			onEach(StackVector<T>::_memory[idx], idx);
+	}
+
+	// Pops elements in priority order for as long as onEach returns true
+	void drain(std::function<bool(T& member, size_t index)>&& onEach) {
+		for (size_t idx = 0; _count; idx++) {
+			std::pop_heap(StackVector<T>::_memory, StackVector<T>::_memory + _count, _compare);
+			T& member = StackVector<T>::_memory[_count - 1];
+			const bool keepGoing = onEach(member, idx);
+			(&member)->~T();
+			_count--;
+			if (!keepGoing)
+				break;
+		}
+	}
+
+protected:
+	size_t   _count;
+	Compare  _compare;
+};
+
+/* Copies the best.count() elements of source that Compare ranks highest into best, best first.
+** best itself is used as the bounded heap, so this runs in O(n log k) without allocating.
+** Returns the number of elements written, which is less than best.count() for short sources. */
+
+template <typename T, typename Compare = std::less<T>> size_t topK(const StackVector<T>& source, StackVector<T>& best, Compare compare = Compare())
+{
+	if (!best.isValid() || !source.isValid())
+		return 0;
+	const size_t k = std::min(best.count(), source.count());
+	if (0 == k)
+		return 0;
+
+	// keep the worst of the kept elements on top so it is the one that gets replaced
+	auto worstOnTop = [&compare](const T& a, const T& b) { return compare(b, a); };
+	// indexing the last slot used makes a lazily constructed best construct all k of them
+	T *heap = &best[k - 1] - (k - 1);
+
+	for (size_t idx = 0; idx < k; idx++)
+		heap[idx] = source[idx];
+	std::make_heap(heap, heap + k, worstOnTop);
+
+	for (size_t idx = k; idx < source.count(); idx++) {
+		if (compare(heap[0], source[idx])) {
+			std::pop_heap(heap, heap + k, worstOnTop);
+			heap[k - 1] = source[idx];
+			std::push_heap(heap, heap + k, worstOnTop);
+		}
+	}
+
+	std::sort_heap(heap, heap + k, worstOnTop);
+	return k;
+}
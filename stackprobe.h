@@ -0,0 +1,355 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+#if defined(__linux__)
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#else
+#include <emul/emulregs.h>
+#include <exec/tasks.h>
+#include <proto/exec.h>
+#endif
+
+#if defined(DEBUG) && DEBUG
+#if !defined(__linux__)
+extern "C" { void dprintf(const char *,...); };
+#endif
+#define SVOUT printf 
+#else
+#define SVOUT(...)
+#endif
+
+/* Pages below this size are never prefaulted in StackVectorPrefault::Auto mode */
+#ifndef STACKVECTOR_PREFAULT_MINPAGES
+#define STACKVECTOR_PREFAULT_MINPAGES 8
+#endif
+
+/* None leaves the pages to be faulted in by whoever touches them first. Always touches every
+** reserved page at construction. Auto does so only for allocations of at least
+** STACKVECTOR_PREFAULT_MINPAGES pages, and on stack only for the pages below the deepest one
+** this thread has already prefaulted, as those are known to be resident. */
+
+enum class StackVectorPrefault { None, Auto, Always };
+
+/* Platform glue: where the current thread's stack lives and how far it's used.
+** MorphOS reads the task's PPC stack bounds, Linux asks pthreads once per thread.
+** Code running on a stack of its own (fibers, ucontext, green threads) must register it
+** with setCustomBounds() or a CustomStackScope, otherwise every StackVector created there
+** lands on the heap since 'this' doesn't look like a stack address. */
+
+#ifndef STACKVECTOR_MAX_CUSTOMSTACKTASKS
+#define STACKVECTOR_MAX_CUSTOMSTACKTASKS 16
+#endif
+
+class StackProbe
+{
+public:
+	static bool bounds(uintptr_t &lower, uintptr_t &upper)
+	{
+#if defined(__linux__)
+		if (customBounds(lower, upper))
+			return true;
+		static thread_local uintptr_t threadLower = 0, threadUpper = 0;
+		if (0 == threadUpper)
+		{
+			pthread_attr_t attr;
+			void *stackAddress = nullptr;
+			size_t stackSize = 0;
+			if (0 != pthread_getattr_np(pthread_self(), &attr))
+				return false;
+			if (0 == pthread_attr_getstack(&attr, &stackAddress, &stackSize))
+			{
+				threadLower = uintptr_t(stackAddress);
+				threadUpper = threadLower + stackSize;
+			}
+			pthread_attr_destroy(&attr);
+		}
+		lower = threadLower;
+		upper = threadUpper;
+		return 0 != threadUpper;
+#else
+		struct Task *t = FindTask(NULL);
+		if (taskCustomBounds(t, lower, upper))
+			return true;
+		lower = uintptr_t(t->tc_ETask->PPCSPLower);
+		upper = uintptr_t(t->tc_ETask->PPCSPUpper);
+		return true;
+#endif
+	}
+
+	// Approximate current stack pointer (at worst a frame below the caller's)
+	__attribute__((noinline)) static bool current(uintptr_t &current)
+	{
+#if defined(__linux__)
+		current = uintptr_t(__builtin_frame_address(0));
+		return true;
+#else
+		uintptr_t lower, upper;
+		return probe(lower, upper, current);
+#endif
+	}
+
+	/* bounds() and current() in one go, which is what StackVector needs to decide on alloca.
+	** On MorphOS that is a single FindTask(), the same as before custom stacks existed, and
+	** the custom stack table is only searched while some task has one registered. */
+	__attribute__((noinline)) static bool probe(uintptr_t &lower, uintptr_t &upper, uintptr_t &current)
+	{
+#if defined(__linux__)
+		current = uintptr_t(__builtin_frame_address(0));
+		return bounds(lower, upper);
+#else
+		struct Task *t = FindTask(NULL);
+		if (taskCustomBounds(t, lower, upper)) {
+			// the task's used stack size only describes its own stack
+			current = uintptr_t(__builtin_frame_address(0));
+			return true;
+		}
+
+		ULONG usedStack = 0;
+		if (0 == NewGetTaskAttrsA(t, &usedStack, sizeof (usedStack), TASKINFOTYPE_USEDSTACKSIZE, NULL))
+			return false;
+		lower = uintptr_t(t->tc_ETask->PPCSPLower);
+		upper = uintptr_t(t->tc_ETask->PPCSPUpper);
+		current = upper - usedStack;
+		return true;
+#endif
+	}
+
+	// Custom stack the calling thread currently runs on, if any was registered
+	static bool customBounds(uintptr_t &lower, uintptr_t &upper)
+	{
+#if defined(__linux__)
+		const CustomStack &custom = threadCustomStack();
+		lower = custom.lower;
+		upper = custom.upper;
+		return 0 != upper;
+#else
+		return taskCustomBounds(FindTask(NULL), lower, upper);
+#endif
+	}
+
+	/* Registers [lower, upper) as the calling thread's stack until cleared; pass 0, 0 to clear.
+	** Returns false if the range could not be recorded (MorphOS task table full). */
+	static bool setCustomBounds(const uintptr_t lower, const uintptr_t upper)
+	{
+#if defined(__linux__)
+		CustomStack &custom = threadCustomStack();
+		custom.lower = lower;
+		custom.upper = upper;
+		return true;
+#else
+		bool stored = false;
+		struct Task *t = FindTask(NULL);
+		Forbid();
+		for (size_t i = 0; i < STACKVECTOR_MAX_CUSTOMSTACKTASKS && !stored; i++) {
+			if (customStacks()[i].task == t) {
+				customStacks()[i].lower = lower;
+				customStacks()[i].upper = upper;
+				if (0 == upper) {
+					customStacks()[i].task = nullptr;
+					customStackCount()--;
+				}
+				stored = true;
+			}
+		}
+		for (size_t i = 0; i < STACKVECTOR_MAX_CUSTOMSTACKTASKS && !stored && 0 != upper; i++) {
+			if (nullptr == customStacks()[i].task) {
+				customStacks()[i].task = t;
+				customStacks()[i].lower = lower;
+				customStacks()[i].upper = upper;
+				customStackCount()++;
+				stored = true;
+			}
+		}
+		Permit();
+		return stored || 0 == upper;
+#endif
+	}
+
+	static bool isStackAddress(const void *address)
+	{
+		uintptr_t lower, upper;
+		if (!bounds(lower, upper))
+			return false;
+		SVOUT("%s: lower %p upper %p addr %p \n", __PRETTY_FUNCTION__, (void *)lower, (void *)upper, address);
+		return (uintptr_t(address) > lower) && (uintptr_t(address) < upper);
+	}
+
+	static size_t pageSize()
+	{
+#if defined(__linux__)
+		static const size_t size = size_t(sysconf(_SC_PAGESIZE));
+		return size;
+#else
+		return 4096;
+#endif
+	}
+
+	/* Touches every page of a fresh allocation so the faults are taken here and not in the
+	** caller's first fill. Stack memory is walked top-down, in the direction the stack grows,
+	** so consecutive touches are never more than a page apart and cannot hop over a guard
+	** page. Heap memory is populated with a single madvise() where the kernel supports it. */
+	static void prefault(void *memory, const size_t bytes, const bool onStack, const StackVectorPrefault mode)
+	{
+#if defined(__linux__)
+		const size_t page = pageSize();
+		uintptr_t low = uintptr_t(memory);
+		uintptr_t high = low + bytes;
+
+		if (StackVectorPrefault::None == mode || 0 == bytes)
+			return;
+		if (StackVectorPrefault::Auto == mode && bytes < STACKVECTOR_PREFAULT_MINPAGES * page)
+			return;
+
+		if (onStack)
+		{
+			static thread_local uintptr_t touchedLow = 0;
+			uintptr_t lower, upper;
+			if (!bounds(lower, upper) || touchedLow <= lower || touchedLow >= upper)
+				touchedLow = UINTPTR_MAX;
+
+			if (StackVectorPrefault::Auto == mode && touchedLow < high)
+			{
+				if (touchedLow <= low)
+					return;
+				high = touchedLow;
+			}
+
+			for (uintptr_t p = (high - 1) & ~uintptr_t(page - 1); ; p -= page)
+			{
+				*reinterpret_cast<volatile char *>(p < low ? low : p) = 0;
+				if (p <= low)
+					break;
+			}
+
+			if (low < touchedLow)
+				touchedLow = low;
+			SVOUT("%s: prefaulted stack %p-%p\n", __PRETTY_FUNCTION__, (void *)low, (void *)high);
+		}
+		else
+		{
+#if defined(MADV_POPULATE_WRITE)
+			const uintptr_t first = (low + page - 1) & ~uintptr_t(page - 1);
+			const uintptr_t last = high & ~uintptr_t(page - 1);
+			if (last > first && 0 == madvise(reinterpret_cast<void *>(first), last - first, MADV_POPULATE_WRITE))
+			{
+				// partial pages at either end are not covered by the madvise() range
+				*reinterpret_cast<volatile char *>(low) = 0;
+				*reinterpret_cast<volatile char *>(high - 1) = 0;
+				SVOUT("%s: populated heap %p-%p\n", __PRETTY_FUNCTION__, (void *)low, (void *)high);
+				return;
+			}
+#endif
+			for (uintptr_t p = low; p < high; p += page)
+				*reinterpret_cast<volatile char *>(p) = 0;
+			*reinterpret_cast<volatile char *>(high - 1) = 0;
+			SVOUT("%s: prefaulted heap %p-%p\n", __PRETTY_FUNCTION__, (void *)low, (void *)high);
+		}
+#else
+		// no demand paging on MorphOS, memory is always backed
+		(void)memory; (void)bytes; (void)onStack; (void)mode;
+#endif
+	}
+
+protected:
+	struct CustomStack
+	{
+#if !defined(__linux__)
+		struct Task *task;
+#endif
+		uintptr_t    lower;
+		uintptr_t    upper;
+	};
+
+#if defined(__linux__)
+	static CustomStack &threadCustomStack()
+	{
+		static thread_local CustomStack custom = { 0, 0 };
+		return custom;
+	}
+#else
+	static CustomStack *customStacks()
+	{
+		static CustomStack stacks[STACKVECTOR_MAX_CUSTOMSTACKTASKS];
+		return stacks;
+	}
+
+	// Tasks in customStacks(), read without Forbid(): only t itself adds or removes t's entry
+	static size_t &customStackCount()
+	{
+		static size_t count = 0;
+		return count;
+	}
+
+	static bool taskCustomBounds(struct Task *t, uintptr_t &lower, uintptr_t &upper)
+	{
+		if (0 == customStackCount())
+			return false;
+
+		bool found = false;
+		Forbid();
+		for (size_t i = 0; i < STACKVECTOR_MAX_CUSTOMSTACKTASKS; i++) {
+			if (customStacks()[i].task == t) {
+				lower = customStacks()[i].lower;
+				upper = customStacks()[i].upper;
+				found = true;
+				break;
+			}
+		}
+		Permit();
+		return found;
+	}
+#endif
+};
+
+/* Marks the calling thread as running on a custom stack for the lifetime of the scope and then
+** restores whatever was registered before. Wrap the context switch that enters the custom stack:
+**  {
+**    CustomStackScope scope(fiberStack, fiberStackSize);
+**    swapcontext(&schedulerContext, &fiberContext);
+**  }
+** Once the switch returns the thread is back on the previous stack and so is StackProbe. */
+
+class CustomStackScope
+{
+public:
+	CustomStackScope(void *stack, const size_t size)
+	{
+		_hadPrevious = StackProbe::customBounds(_previousLower, _previousUpper);
+		StackProbe::setCustomBounds(uintptr_t(stack), uintptr_t(stack) + size);
+	}
+
+	~CustomStackScope()
+	{
+		if (_hadPrevious)
+			StackProbe::setCustomBounds(_previousLower, _previousUpper);
+		else
+			StackProbe::setCustomBounds(0, 0);
+	}
+
+	CustomStackScope() = delete;
+	CustomStackScope(const CustomStackScope&) = delete;
+	CustomStackScope& operator=(const CustomStackScope&) = delete;
+
+protected:
+	uintptr_t _previousLower;
+	uintptr_t _previousUpper;
+	bool      _hadPrevious;
+};
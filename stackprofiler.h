@@ -0,0 +1,213 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#if defined(__has_include)
+#if __has_include(<source_location>) && __cplusplus >= 202002L
+#include <source_location>
+#endif
+#endif
+
+/* Opt-in per call site profiling of StackVector allocations, enabled by building everything
+** with -DSTACKVECTOR_PROFILE. Every StackVector constructor then records where it was called
+** from, how many bytes it wanted, whether it got stack or heap, how long construction took
+** and how long the vector lived. StackProfiler::report() prints the sites sorted by heap
+** fallbacks and then by peak stack use; the same report goes to stderr at exit unless
+** StackProfiler::reportAtExit() is set to false.
+** Classes built on StackVector (StackMatrix, StackPool, the enumerators, ...) take the same
+** trailing location parameter, so their vectors are attributed to the caller rather than to
+** the library. */
+
+#if defined(__cpp_lib_source_location)
+typedef std::source_location StackProfileLocation;
+#else
+/* Same shape as std::source_location, built on the GCC builtins for pre-C++20 compilers */
+struct StackProfileLocation
+{
+	static StackProfileLocation current(const char *file = __builtin_FILE(), const char *function = __builtin_FUNCTION(), unsigned line = __builtin_LINE()) {
+		StackProfileLocation where;
+		where._file = file;
+		where._function = function;
+		where._line = line;
+		return where;
+	}
+	const char *file_name() const { return _file; }
+	const char *function_name() const { return _function; }
+	unsigned line() const { return _line; }
+	unsigned column() const { return 0; }
+
+	const char *_file;
+	const char *_function;
+	unsigned    _line;
+};
+#endif
+
+struct StackProfileSite
+{
+	const char             *file;
+	const char             *function;
+	unsigned                line;
+	unsigned                column;
+	std::atomic<uint64_t>   constructions;
+	std::atomic<uint64_t>   heapFallbacks;
+	std::atomic<uint64_t>   bytes;
+	std::atomic<uint64_t>   peakStackBytes;
+	std::atomic<uint64_t>   peakHeapBytes;
+	std::atomic<uint64_t>   constructNanos;
+	std::atomic<uint64_t>   lifetimeNanos;
+
+	void recordConstruction(const uint64_t size, const bool onStack, const uint64_t nanos) {
+		constructions++;
+		bytes += size;
+		constructNanos += nanos;
+		if (!onStack)
+			heapFallbacks++;
+		std::atomic<uint64_t> &peak = onStack ? peakStackBytes : peakHeapBytes;
+		uint64_t previous = peak.load();
+		while (previous < size && !peak.compare_exchange_weak(previous, size)) { }
+	}
+
+	void recordDestruction(const uint64_t nanos) {
+		lifetimeNanos += nanos;
+	}
+
+	bool matches(const StackProfileLocation &where) const {
+		return file == where.file_name() && line == where.line() && column == where.column() && function == where.function_name();
+	}
+};
+
+/* Call sites remembered lock-free by site(), a power of two */
+#ifndef STACKPROFILER_CACHESLOTS
+#define STACKPROFILER_CACHESLOTS 256
+#endif
+
+class StackProfiler
+{
+public:
+	static uint64_t now() {
+		return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	// Record for the given call site, created on first use and deliberately never freed, so a
+	// vector with static storage that outlives the registry can still record into it.
+	// Sites are looked up in a small lock-free cache first, the registry lock is only taken on a
+	// call site's first construction or when another site took over its cache slot.
+	static StackProfileSite *site(const StackProfileLocation &where) {
+		std::atomic<StackProfileSite *> &slot = instance().cache[cacheSlot(where)];
+		StackProfileSite *cached = slot.load(std::memory_order_acquire);
+		if (cached && cached->matches(where))
+			return cached;
+		cached = registered(where);
+		slot.store(cached, std::memory_order_release);
+		return cached;
+	}
+
+	static bool &reportAtExit() { static bool atExit = true; return atExit; }
+
+	static void report(FILE *out = stderr) {
+		report(instance(), out);
+	}
+
+	// Drops the counters of every site, e.g. between benchmark phases
+	static void reset() {
+		Registry &registry = instance();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		for (auto &entry : registry.sites) {
+			StackProfileSite *site = entry.second;
+			site->constructions = 0;
+			site->heapFallbacks = 0;
+			site->bytes = 0;
+			site->peakStackBytes = 0;
+			site->peakHeapBytes = 0;
+			site->constructNanos = 0;
+			site->lifetimeNanos = 0;
+		}
+	}
+
+protected:
+	typedef std::tuple<const char *, unsigned, unsigned, const char *> Key;
+
+	struct Registry
+	{
+		std::mutex                                            mutex;
+		std::map<Key, StackProfileSite *>                     sites;
+		std::atomic<StackProfileSite *>                       cache[STACKPROFILER_CACHESLOTS] {};
+
+		~Registry() {
+			if (StackProfiler::reportAtExit())
+				StackProfiler::report(*this, stderr);
+		}
+	};
+
+	static Registry &instance() {
+		static Registry registry;
+		return registry;
+	}
+
+	static size_t cacheSlot(const StackProfileLocation &where) {
+		return ((uintptr_t(where.file_name()) >> 4) ^ (where.line() * 31) ^ where.column()) & (STACKPROFILER_CACHESLOTS - 1);
+	}
+
+	static StackProfileSite *registered(const StackProfileLocation &where) {
+		Registry &registry = instance();
+		const Key key(where.file_name(), where.line(), where.column(), where.function_name());
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		StackProfileSite *&site = registry.sites[key];
+		if (!site) {
+			site = new StackProfileSite();
+			site->file = where.file_name();
+			site->function = where.function_name();
+			site->line = where.line();
+			site->column = where.column();
+		}
+		return site;
+	}
+
+	static void report(Registry &registry, FILE *out) {
+		std::vector<StackProfileSite *> sorted;
+		{
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			for (auto &entry : registry.sites)
+				sorted.push_back(entry.second);
+		}
+
+		std::sort(sorted.begin(), sorted.end(), [](const StackProfileSite *a, const StackProfileSite *b) {
+			if (a->heapFallbacks != b->heapFallbacks)
+				return a->heapFallbacks > b->heapFallbacks;
+			return a->peakStackBytes > b->peakStackBytes;
+		});
+
+		fprintf(out, "StackVector allocation profile, %zu call sites\n", sorted.size());
+		fprintf(out, "%10s %10s %12s %12s %12s %12s %12s  %s\n", "count", "heap", "avg bytes", "peak stack", "peak heap", "ctor us", "life us", "site");
+		for (const StackProfileSite *site : sorted) {
+			const uint64_t count = site->constructions;
+			fprintf(out, "%10llu %10llu %12llu %12llu %12llu %12.1f %12.1f  %s:%u %s\n",
+				(unsigned long long)count, (unsigned long long)site->heapFallbacks.load(),
+				(unsigned long long)(count ? site->bytes / count : 0),
+				(unsigned long long)site->peakStackBytes.load(), (unsigned long long)site->peakHeapBytes.load(),
+				site->constructNanos / 1000.0, site->lifetimeNanos / 1000.0,
+				site->file, site->line, site->function);
+		}
+	}
+};
@@ -0,0 +1,209 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <utility>
+#include "stackvector.h"
+
+/* Double ended queue with a fixed power of two capacity, meant as a replacement for std::deque
+** in breadth-first walks and sliding windows. The initial ring uses the StackVector stack-or-heap
+** decision; pushing into a full ring promotes it to a heap ring of twice the size, so the common
+** case never allocates and the uncommon one still works.
+** Example (breadth-first walk over a MUI object tree):
+**  StackRing<id> queue(64);
+**  queue.pushBack(root);
+**  while (!queue.isEmpty()) {
+**    id obj = queue.popFront();
+**    if ([obj conformsToProtocol:@protocol(MUIFamily)])
+**      FastFamilyForEach<id>(obj, [&queue](id& child, size_t) { queue.pushBack(child); });
+**  }
+*/
+
+template <typename T> class StackRing : protected StackVector<T>
+{
+public:
+	/* MUST be inlined or alloca() would fail to survive past this method */
+	__attribute__((always_inline)) StackRing(const size_t capacity, const size_t mustLeaveStackSizeForScope = (16 * 1024) STACKVECTOR_PROFILE_WHERE)
+		: StackVector<T>(roundCapacity(capacity), mustLeaveStackSizeForScope, false, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS)
+		, _ring(StackVector<T>::_memory), _mask(roundCapacity(capacity) - 1), _head(0), _count(0), _heapRing(false)
+	{
+	}
+
+	StackRing() = delete;
+	StackRing(const StackRing&) = delete;
+	StackRing& operator=(const StackRing&) = delete;
+
+	~StackRing()
+	{
+		clear();
+		if (_heapRing)
+		{
+			SVOUT("%s: freeing promoted ring %p..\n", __PRETTY_FUNCTION__, _ring);
+			free(_ring);
+		}
+	}
+
+	size_t capacity() const { return _ring ? _mask + 1 : 0; }
+	size_t count() const { return _count; }
+	bool isEmpty() const { return 0 == _count; }
+	bool isValid() const { return _ring != nullptr; }
+	// True once the ring outgrew its initial storage and moved to the heap
+	bool isPromoted() const { return _heapRing; }
+
+	using StackVector<T>::isAllocatedOnStack;
+
+	T& front() { return _ring[_head]; }
+	T& back() { return _ring[(_head + _count - 1) & _mask]; }
+	const T& front() const { return _ring[_head]; }
+	const T& back() const { return _ring[(_head + _count - 1) & _mask]; }
+
+	// Index 0 is front()
+	T& operator[](size_t index) {
+#ifdef STACKVECTORDEBUG
+		if (index >= _count)
+		{
+			SVOUT("%s: Access at %d outside of count %d\n", __PRETTY_FUNCTION__, index, _count);
+		}
+#endif
+		return _ring[(_head + index) & _mask];
+	}
+
+	T const & operator[](size_t index) const {
+#ifdef STACKVECTORDEBUG
+		if (index >= _count)
+		{
+			SVOUT("%s: Access at %d outside of count %d\n", __PRETTY_FUNCTION__, index, _count);
+		}
+#endif
+		return _ring[(_head + index) & _mask];
+	}
+
+	// All push methods return false only if the ring was full and could not be promoted
+	bool pushBack(const T& value) { return emplaceBack(value); }
+	bool pushBack(T&& value) { return emplaceBack(std::move(value)); }
+	bool pushFront(const T& value) { return emplaceFront(value); }
+	bool pushFront(T&& value) { return emplaceFront(std::move(value)); }
+
+	template <typename... Args> bool emplaceBack(Args&&... args) {
+		if (!makeRoom())
+			return false;
+		new (&_ring[(_head + _count) & _mask]) T (std::forward<Args>(args)...);
+		_count++;
+		return true;
+	}
+
+	template <typename... Args> bool emplaceFront(Args&&... args) {
+		if (!makeRoom())
+			return false;
+		_head = (_head - 1) & _mask;
+		new (&_ring[_head]) T (std::forward<Args>(args)...);
+		_count++;
+		return true;
+	}
+
+	// Popping an empty ring is undefined, as with std::deque
+	T popFront() {
+		T value(std::move(_ring[_head]));
+		(&_ring[_head])->~T();
+		_head = (_head + 1) & _mask;
+		_count--;
+		return value;
+	}
+
+	T popBack() {
+		T& slot = _ring[(_head + _count - 1) & _mask];
+		T value(std::move(slot));
+		(&slot)->~T();
+		_count--;
+		return value;
+	}
+
+	void clear() {
+		while (_count) {
+			(&_ring[(_head + _count - 1) & _mask])->~T();
+			_count--;
+		}
+		_head = 0;
+	}
+
+	// Iterates front to back
+	void forEach(std::function<void(T& member, size_t index)>&& onEach) {
+		for (size_t idx = 0; idx < _count; idx++)
+			onEach(_ring[(_head + idx) & _mask], idx);
+	}
+
+	void forEach(std::function<void(const T& member, size_t index)>&& onEach) const {
+		for (size_t idx = 0; idx < _count; idx++)
+			onEach(_ring[(_head + idx) & _mask], idx);
+	}
+
+	void whileEach(std::function<bool(T& member, size_t index)>&& onEach) {
+		for (size_t idx = 0; idx < _count; idx++) {
+			if (!onEach(_ring[(_head + idx) & _mask], idx))
+				break;
+		}
+	}
+
+	void whileEach(std::function<bool(const T& member, size_t index)>&& onEach) const {
+		for (size_t idx = 0; idx < _count; idx++) {
+			if (!onEach(_ring[(_head + idx) & _mask], idx))
+				break;
+		}
+	}
+
+protected:
+	static size_t roundCapacity(const size_t capacity) {
+		size_t rounded = 1;
+		while (rounded < capacity)
+			rounded <<= 1;
+		return rounded;
+	}
+
+	bool makeRoom() {
+		if (!_ring)
+			return false;
+		if (_count <= _mask)
+			return true;
+
+		// full: move everything into a heap ring twice as large, unwrapped so that _head becomes 0
+		const size_t newCapacity = (_mask + 1) * 2;
+		T *promoted = static_cast<T*>(malloc(newCapacity * sizeof(T)));
+		if (!promoted)
+			return false;
+
+		SVOUT("%s: promoting ring of %d to heap %p of %d\n", __PRETTY_FUNCTION__, _mask + 1, promoted, newCapacity);
+
+		for (size_t idx = 0; idx < _count; idx++) {
+			T& slot = _ring[(_head + idx) & _mask];
+			new (&promoted[idx]) T (std::move(slot));
+			(&slot)->~T();
+		}
+
+		if (_heapRing)
+			free(_ring);
+
+		_ring = promoted;
+		_mask = newCapacity - 1;
+		_head = 0;
+		_heapRing = true;
+		return true;
+	}
+
+	T       *_ring;
+	size_t   _mask;
+	size_t   _head;
+	size_t   _count;
+	bool     _heapRing;
+};
@@ -0,0 +1,246 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <cstring>
+#include <functional>
+#include <utility>
+#include "stackparallel.h"
+
+/* Prefix sums over StackVectors, e.g. turning per-bucket counts into offsets for compaction.
+** Inclusive: target[i] = source[0] op .. op source[i]. Exclusive: target[i] = initial op
+** source[0] op .. op source[i - 1]. All take either one vector, scanned in place, or a source
+** and a target of which the first min(count) elements are used; all return the grand total.
+** Integer sums run through a 16 byte SIMD kernel (GCC vector extensions, so SSE, NEON or
+** AltiVec alike); floating point and other operations are scanned in order, serially. The
+** parallel versions make two passes over blocks: block totals first, then every block is
+** scanned starting from the total of the blocks before it. That reassociates op, so use them
+** for associative operations only (floating point sums will round differently). */
+
+/* Vectors shorter than this are scanned serially by the parallel versions */
+#ifndef STACKSCAN_PARALLEL_CUTOFF
+#define STACKSCAN_PARALLEL_CUTOFF (256 * 1024)
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+#define STACKSCAN_SIMD 1
+#else
+#define STACKSCAN_SIMD 0
+#endif
+
+template <typename T, typename Op> struct StackScanSimd : std::integral_constant<bool, STACKSCAN_SIMD && std::is_integral<T>::value && !std::is_same<T, bool>::value
+	&& sizeof(T) <= 8 && std::is_same<Op, std::plus<T>>::value> {};
+
+#if STACKSCAN_SIMD
+/* 16 byte vector of integer T and its in-register prefix sum, log2(lanes) shift and add steps */
+template <typename T> struct StackScanVector
+{
+	static const size_t Lanes = 16 / sizeof(T);
+	typedef T Vector __attribute__((vector_size(16)));
+	typedef typename std::make_signed<T>::type Lane;
+	typedef Lane Mask __attribute__((vector_size(16)));
+
+	static Vector broadcast(const T value)
+	{
+		Vector v;
+		for (size_t i = 0; i < Lanes; i++)
+			v[i] = value;
+		return v;
+	}
+
+	// every lane moves up by Shift, the lowest ones become zero
+	template <size_t Shift, size_t... Index> static Vector shiftUp(const Vector v, std::index_sequence<Index...>)
+	{
+		return __builtin_shuffle(v, Vector{}, Mask{ Lane(Index < Shift ? Lanes : Index - Shift)... });
+	}
+
+	template <size_t Shift> static Vector prefix(const Vector v, std::true_type /* done */)
+	{
+		return v;
+	}
+
+	template <size_t Shift> static Vector prefix(const Vector v, std::false_type)
+	{
+		const Vector summed = v + shiftUp<Shift>(v, std::make_index_sequence<Lanes>());
+		return prefix<Shift * 2>(summed, std::integral_constant<bool, (Shift * 2 >= Lanes)>());
+	}
+};
+#endif
+
+template <typename T> class StackScanKernel
+{
+public:
+	/* Scans count elements of in into out (which may be in), continuing from carry if hasCarry.
+	** Returns the total including the last element */
+	template <typename Op> static T scan(const T *in, T *out, const size_t count, Op &op, const bool exclusive, bool hasCarry, T carry)
+	{
+		return scan(in, out, count, op, exclusive, hasCarry, carry, StackScanSimd<T, Op>());
+	}
+
+	// Combines count > 0 elements
+	template <typename Op> static T reduce(const T *in, const size_t count, Op &op)
+	{
+		T total = in[0];
+		for (size_t i = 1; i < count; i++)
+			total = op(total, in[i]);
+		return total;
+	}
+
+protected:
+	template <typename Op> static T scan(const T *in, T *out, const size_t count, Op &op, const bool exclusive, bool hasCarry, T carry, std::false_type)
+	{
+		for (size_t i = 0; i < count; i++) {
+			const T value = in[i];
+			const T next = hasCarry ? op(carry, value) : value;
+			out[i] = exclusive ? carry : next;
+			carry = next;
+			hasCarry = true;
+		}
+		return carry;
+	}
+
+#if STACKSCAN_SIMD
+	template <typename Op> static T scan(const T *in, T *out, const size_t count, Op &op, const bool exclusive, const bool hasCarry, const T carry, std::true_type)
+	{
+		typedef StackScanVector<T> V;
+
+		// for integer sums starting from 0 is the same as starting without a carry
+		typename V::Vector running = V::broadcast(hasCarry ? carry : T(0));
+		size_t i = 0;
+		for (; i + V::Lanes <= count; i += V::Lanes) {
+			typename V::Vector v;
+			memcpy(&v, in + i, sizeof(v));
+			const typename V::Vector inclusive = V::template prefix<1>(v, std::false_type()) + running;
+			const typename V::Vector result = exclusive ? inclusive - v : inclusive;
+			memcpy(out + i, &result, sizeof(result));
+			running = V::broadcast(inclusive[V::Lanes - 1]);
+		}
+		return scan(in + i, out + i, count - i, op, exclusive, true, running[0], std::false_type());
+	}
+#else
+	template <typename Op> static T scan(const T *in, T *out, const size_t count, Op &op, const bool exclusive, const bool hasCarry, const T carry, std::true_type)
+	{
+		return scan(in, out, count, op, exclusive, hasCarry, carry, std::false_type());
+	}
+#endif
+};
+
+/* Element storage of a vector, constructing whatever a lazy one still owes */
+template <typename T> T *stackScanData(StackVector<T> &vector)
+{
+	vector[vector.count() - 1];
+	return &vector[0];
+}
+
+template <typename T> const T *stackScanData(const StackVector<T> &vector)
+{
+	vector[vector.count() - 1];
+	return &vector[0];
+}
+
+template <typename T, typename Op = std::plus<T>> T inclusiveScan(StackVector<T> &vector, Op op = Op())
+{
+	if (!vector.isValid())
+		return T();
+	T *data = stackScanData(vector);
+	return StackScanKernel<T>::scan(data, data, vector.count(), op, false, false, T());
+}
+
+template <typename T, typename Op = std::plus<T>> T inclusiveScan(const StackVector<T> &source, StackVector<T> &target, Op op = Op())
+{
+	if (!source.isValid() || !target.isValid())
+		return T();
+	return StackScanKernel<T>::scan(stackScanData(source), stackScanData(target), std::min(source.count(), target.count()), op, false, false, T());
+}
+
+template <typename T, typename Op = std::plus<T>> T exclusiveScan(StackVector<T> &vector, const T initial = T(), Op op = Op())
+{
+	if (!vector.isValid())
+		return initial;
+	T *data = stackScanData(vector);
+	return StackScanKernel<T>::scan(data, data, vector.count(), op, true, true, initial);
+}
+
+template <typename T, typename Op = std::plus<T>> T exclusiveScan(const StackVector<T> &source, StackVector<T> &target, const T initial = T(), Op op = Op())
+{
+	if (!source.isValid() || !target.isValid())
+		return initial;
+	return StackScanKernel<T>::scan(stackScanData(source), stackScanData(target), std::min(source.count(), target.count()), op, true, true, initial);
+}
+
+/* Two pass parallel scan of count elements; the block totals live in a StackVector, so this
+** MUST be inlined into the caller like any StackVector constructor */
+template <typename T, typename Op> __attribute__((always_inline)) inline T stackParallelScan(const T *in, T *out, const size_t count, Op &op, const bool exclusive, const bool hasInitial, const T initial, StackTaskPool &pool, const size_t cutoff)
+{
+	const size_t blocks = pool.concurrency();
+	if (count < cutoff || blocks < 2)
+		return StackScanKernel<T>::scan(in, out, count, op, exclusive, hasInitial, initial);
+
+	StackVector<T> carries(blocks, 16 * 1024, !std::is_trivial<T>::value);
+	if (!carries.isValid())
+		return StackScanKernel<T>::scan(in, out, count, op, exclusive, hasInitial, initial);
+	T *carry = &carries[0];
+
+	pool.run(blocks, [=, &op](size_t block) {
+		const size_t first = count * block / blocks;
+		carry[block] = StackScanKernel<T>::reduce(in + first, count * (block + 1) / blocks - first, op);
+	});
+
+	// block totals become the carry into each block; the first one only has the initial value, if any
+	T total = hasInitial ? op(initial, carry[0]) : carry[0];
+	carry[0] = initial;
+	for (size_t block = 1; block < blocks; block++) {
+		const T blockTotal = carry[block];
+		carry[block] = total;
+		total = op(total, blockTotal);
+	}
+
+	pool.run(blocks, [=, &op](size_t block) {
+		const size_t first = count * block / blocks;
+		StackScanKernel<T>::scan(in + first, out + first, count * (block + 1) / blocks - first, op, exclusive, block > 0 || hasInitial, carry[block]);
+	});
+
+	return total;
+}
+
+template <typename T, typename Op = std::plus<T>> __attribute__((always_inline)) inline T parallelInclusiveScan(StackVector<T> &vector, Op op = Op(), StackTaskPool &pool = StackTaskPool::shared(), const size_t cutoff = STACKSCAN_PARALLEL_CUTOFF)
+{
+	if (!vector.isValid())
+		return T();
+	T *data = stackScanData(vector);
+	return stackParallelScan(data, data, vector.count(), op, false, false, T(), pool, cutoff);
+}
+
+template <typename T, typename Op = std::plus<T>> __attribute__((always_inline)) inline T parallelInclusiveScan(const StackVector<T> &source, StackVector<T> &target, Op op = Op(), StackTaskPool &pool = StackTaskPool::shared(), const size_t cutoff = STACKSCAN_PARALLEL_CUTOFF)
+{
+	if (!source.isValid() || !target.isValid())
+		return T();
+	return stackParallelScan(stackScanData(source), stackScanData(target), std::min(source.count(), target.count()), op, false, false, T(), pool, cutoff);
+}
+
+template <typename T, typename Op = std::plus<T>> __attribute__((always_inline)) inline T parallelExclusiveScan(StackVector<T> &vector, const T initial = T(), Op op = Op(), StackTaskPool &pool = StackTaskPool::shared(), const size_t cutoff = STACKSCAN_PARALLEL_CUTOFF)
+{
+	if (!vector.isValid())
+		return initial;
+	T *data = stackScanData(vector);
+	return stackParallelScan(data, data, vector.count(), op, true, true, initial, pool, cutoff);
+}
+
+template <typename T, typename Op = std::plus<T>> __attribute__((always_inline)) inline T parallelExclusiveScan(const StackVector<T> &source, StackVector<T> &target, const T initial = T(), Op op = Op(), StackTaskPool &pool = StackTaskPool::shared(), const size_t cutoff = STACKSCAN_PARALLEL_CUTOFF)
+{
+	if (!source.isValid() || !target.isValid())
+		return initial;
+	return stackParallelScan(stackScanData(source), stackScanData(target), std::min(source.count(), target.count()), op, true, true, initial, pool, cutoff);
+}
@@ -0,0 +1,269 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include "stackvector.h"
+
+/* Scratch memory for temporaries that doesn't come from the thread's stack: a large region
+** per thread used as a second stack, handed out and taken back strictly in LIFO order. Unlike
+** StackVector, ScratchVector needs no inlined constructor, works on worker threads with small
+** stacks and can be created anywhere, as long as vectors go away in the reverse order of their
+** creation (plain scoped locals always do). When the region is full, vectors spill to the heap.
+** Linux gives every thread a region of STACKSCRATCH_REGIONBYTES address space on first use,
+** pages get committed only once touched. MorphOS tasks install a region with a
+** ScratchRegionScope; without one ScratchVectors always use the heap. */
+
+#ifndef STACKSCRATCH_REGIONBYTES
+#if defined(__linux__)
+#define STACKSCRATCH_REGIONBYTES (64 * 1024 * 1024)
+#else
+#define STACKSCRATCH_REGIONBYTES (1024 * 1024)
+#endif
+#endif
+
+#ifndef STACKSCRATCH_MAX_TASKS
+#define STACKSCRATCH_MAX_TASKS 16
+#endif
+
+class ScratchRegion
+{
+public:
+	ScratchRegion(const size_t bytes = STACKSCRATCH_REGIONBYTES) : _base(nullptr), _top(nullptr), _end(nullptr), _highWater(nullptr), _maxAlignment(Granule)
+	{
+#if defined(__linux__)
+		void *memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (MAP_FAILED != memory)
+#else
+		void *memory = malloc(bytes);
+		if (memory)
+#endif
+		{
+			_base = _top = _highWater = static_cast<unsigned char *>(memory);
+			_end = _base + bytes;
+		}
+		SVOUT("%s: region %p size %d\n", __PRETTY_FUNCTION__, _base, int(bytes));
+	}
+
+	~ScratchRegion()
+	{
+		if (_base) {
+#if defined(__linux__)
+			munmap(_base, _end - _base);
+#else
+			free(_base);
+#endif
+		}
+	}
+
+	ScratchRegion(const ScratchRegion&) = delete;
+	ScratchRegion& operator=(const ScratchRegion&) = delete;
+
+	// nullptr when the region can't take the allocation
+	void *allocate(const size_t bytes, size_t alignment)
+	{
+		if (!_base)
+			return nullptr;
+
+		if (alignment < Granule)
+			alignment = Granule;
+		if (alignment > _maxAlignment)
+			_maxAlignment = alignment;
+
+		unsigned char *memory = reinterpret_cast<unsigned char *>((uintptr_t(_top) + alignment - 1) & ~uintptr_t(alignment - 1));
+		if (memory > _end || rounded(bytes) > size_t(_end - memory))
+			return nullptr;
+
+		_top = memory + rounded(bytes);
+		if (_top > _highWater)
+			_highWater = _top;
+		return memory;
+	}
+
+	// Must be the most recent allocation still alive; padding in front of it is reclaimed by the one below
+	void release(void *memory, const size_t bytes)
+	{
+#ifdef STACKVECTORDEBUG
+		// sizes are kept in whole granules, so only over-aligned allocations leave gaps above their predecessor
+		unsigned char *end = static_cast<unsigned char *>(memory) + rounded(bytes);
+		if (end > _top || size_t(_top - end) >= _maxAlignment)
+		{
+			SVOUT("%s: release of %p size %d out of LIFO order, top is %p\n", __PRETTY_FUNCTION__, memory, int(bytes), _top);
+			abort();
+		}
+#else
+		(void)bytes;
+#endif
+		_top = static_cast<unsigned char *>(memory);
+	}
+
+	bool contains(const void *memory) const { return memory >= _base && memory < _end; }
+	size_t used() const { return _top - _base; }
+	size_t capacity() const { return _end - _base; }
+	// Deepest use since the region was created
+	size_t highWater() const { return _highWater - _base; }
+
+	// The calling thread's region, nullptr on MorphOS tasks that didn't install one
+	static ScratchRegion *current()
+	{
+#if defined(__linux__)
+		ScratchRegion *&installed = threadRegion();
+		if (nullptr == installed)
+		{
+			static thread_local ScratchRegion region;
+			installed = &region;
+		}
+		return installed;
+#else
+		ScratchRegion *region = nullptr;
+		struct Task *t = FindTask(NULL);
+		Forbid();
+		for (size_t i = 0; i < STACKSCRATCH_MAX_TASKS; i++) {
+			if (taskRegions()[i].task == t) {
+				region = taskRegions()[i].region;
+				break;
+			}
+		}
+		Permit();
+		return region;
+#endif
+	}
+
+	// Installs region for the calling thread, nullptr goes back to the default; false if the task table is full
+	static bool setCurrent(ScratchRegion *region)
+	{
+#if defined(__linux__)
+		threadRegion() = region;
+		return true;
+#else
+		bool stored = false;
+		struct Task *t = FindTask(NULL);
+		Forbid();
+		for (size_t i = 0; i < STACKSCRATCH_MAX_TASKS && !stored; i++) {
+			if (taskRegions()[i].task == t) {
+				taskRegions()[i].region = region;
+				if (nullptr == region)
+					taskRegions()[i].task = nullptr;
+				stored = true;
+			}
+		}
+		for (size_t i = 0; i < STACKSCRATCH_MAX_TASKS && !stored && region; i++) {
+			if (nullptr == taskRegions()[i].task) {
+				taskRegions()[i].task = t;
+				taskRegions()[i].region = region;
+				stored = true;
+			}
+		}
+		Permit();
+		return stored || nullptr == region;
+#endif
+	}
+
+protected:
+	static const size_t Granule = 16;
+
+	static size_t rounded(const size_t bytes) { return (bytes + Granule - 1) & ~(Granule - 1); }
+
+#if defined(__linux__)
+	static ScratchRegion *&threadRegion()
+	{
+		static thread_local ScratchRegion *installed = nullptr;
+		return installed;
+	}
+#else
+	struct TaskRegion
+	{
+		struct Task   *task;
+		ScratchRegion *region;
+	};
+
+	static TaskRegion *taskRegions()
+	{
+		static TaskRegion regions[STACKSCRATCH_MAX_TASKS];
+		return regions;
+	}
+#endif
+
+	unsigned char *_base;
+	unsigned char *_top;
+	unsigned char *_end;
+	unsigned char *_highWater;
+	size_t         _maxAlignment;
+};
+
+/* Owns a region of the given size and makes it the calling thread's scratch region for its lifetime */
+
+class ScratchRegionScope
+{
+public:
+	ScratchRegionScope(const size_t bytes = STACKSCRATCH_REGIONBYTES) : _region(bytes), _previous(ScratchRegion::current())
+	{
+		ScratchRegion::setCurrent(&_region);
+	}
+
+	~ScratchRegionScope()
+	{
+		ScratchRegion::setCurrent(_previous);
+	}
+
+	ScratchRegionScope(const ScratchRegionScope&) = delete;
+	ScratchRegionScope& operator=(const ScratchRegionScope&) = delete;
+
+	ScratchRegion &region() { return _region; }
+
+protected:
+	ScratchRegion  _region;
+	ScratchRegion *_previous;
+};
+
+/* StackVector taking its storage from the thread's scratch region, or the heap once that is full */
+
+template <typename T> class ScratchVector : public StackVector<T>
+{
+public:
+	ScratchVector(const size_t size, bool callConstructorsDestructors = true)
+		: ScratchVector(size, ScratchRegion::current(), callConstructorsDestructors)
+	{
+	}
+
+	ScratchVector() = delete;
+	ScratchVector(const ScratchVector&) = delete;
+	ScratchVector& operator=(const ScratchVector&) = delete;
+
+	~ScratchVector()
+	{
+		if (_region) {
+			StackVector<T>::destroyFrom(0);
+			_region->release(StackVector<T>::_memory, StackVector<T>::_size * sizeof(T));
+		}
+	}
+
+	// True if the storage lives in the scratch region, false if it spilled to the heap
+	bool isAllocatedInRegion() const { return nullptr != _region; }
+
+protected:
+	ScratchVector(const size_t size, ScratchRegion *region, bool callConstructorsDestructors)
+		: ScratchVector(size, region, region ? region->allocate(size * sizeof(T), alignof(T)) : nullptr, callConstructorsDestructors)
+	{
+	}
+
+	ScratchVector(const size_t size, ScratchRegion *region, void *memory, bool callConstructorsDestructors)
+		: StackVector<T>(static_cast<T*>(memory ? memory : malloc(size * sizeof(T))), size, callConstructorsDestructors, nullptr == memory)
+		, _region(memory ? region : nullptr)
+	{
+		SVOUT("%s: %d elements %s %p\n", __PRETTY_FUNCTION__, int(size), memory ? "in region" : "spilled to heap", StackVector<T>::_memory);
+	}
+
+	ScratchRegion *_region;
+};
@@ -15,19 +15,283 @@ IN THE SOFTWARE.
 */
 #pragma once
 #include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <new>
 #include <string>
+#if defined(__linux__)
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#else
 #include <emul/emulregs.h>
 #include <exec/tasks.h>
 #include <proto/exec.h>
+#endif
 #include <alloca.h>
 #include <functional>
+#if defined(STACKVECTOR_PROFILE)
+#include "stackprofiler.h"
+#endif
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include "stackprobe.h"
 
-#if defined(DEBUG) && DEBUG
-extern "C" { void dprintf(const char *,...); };
-#define SVOUT printf 
+/* Last constructor parameter of StackVector and of everything built on it. With
+** -DSTACKVECTOR_PROFILE it captures the caller's source location, which classes built on
+** StackVector hand on with STACKVECTOR_PROFILE_PASS so that the allocation is attributed to
+** their user rather than to the library. Without the define all of these expand to nothing. */
+#if defined(STACKVECTOR_PROFILE)
+#define STACKVECTOR_PROFILE_WHERE , const StackProfileLocation &where = StackProfileLocation::current()
+#define STACKVECTOR_PROFILE_WHERE_ONLY const StackProfileLocation &where = StackProfileLocation::current()
+#define STACKVECTOR_PROFILE_PASS , where
+#else
+#define STACKVECTOR_PROFILE_WHERE
+#define STACKVECTOR_PROFILE_WHERE_ONLY
+#define STACKVECTOR_PROFILE_PASS
+#endif
+
+/* Non-owning view over a contiguous run of elements, e.g. a single StackMatrix row.
+** Only valid for as long as the storage it points into. */
+
+template <typename T> struct StackSpan
+{
+	T      *data;
+	size_t  size;
+
+	T* begin() const { return data; }
+	T* end() const { return data + size; }
+	size_t count() const { return size; }
+	T& operator[](size_t index) const { return data[index]; }
+};
+
+/* True for iterators that can be walked more than once, which the bulk constructors need to size the vector */
+template <typename I, typename = void> struct StackForwardIterator : std::false_type {};
+template <typename I> struct StackForwardIterator<I, typename std::enable_if<std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<I>::iterator_category>::value>::type> : std::true_type {};
+
+#if defined(STACKVECTOR_WATERMARK)
+#include "stackwatermark.h"
+#endif
+
+/* Heap allocations of at least this many bytes are mapped directly (Linux only, 0 disables) */
+#ifndef STACKVECTOR_MMAP_THRESHOLD
+#define STACKVECTOR_MMAP_THRESHOLD (4 * 1024 * 1024)
+#endif
+
+/* Whether mapped allocations ask for transparent huge pages */
+#ifndef STACKVECTOR_MMAP_HUGEPAGES
+#define STACKVECTOR_MMAP_HUGEPAGES 0
+#endif
+
+/* NUMA placement of heap tier blocks of at least STACKVECTOR_NUMA_MINBYTES. FirstTouch populates
+** the block from the constructing thread, so under the default local policy fresh pages land on
+** its node instead of on whichever thread writes first. Bind also prefers that node with mbind()
+** and migrates pages already present, which covers blocks malloc recycled from another node;
+** it is skipped when the thread runs under an explicit memory policy (numactl and friends). */
+enum class StackHeapNuma { None, FirstTouch, Bind };
+
+#ifndef STACKVECTOR_NUMA
+#define STACKVECTOR_NUMA StackHeapNuma::None
+#endif
+
+#ifndef STACKVECTOR_NUMA_MINBYTES
+#define STACKVECTOR_NUMA_MINBYTES (256 * 1024)
+#endif
+
+/* How many elements ahead pointer iteration prefetches the pointed-to object, 0 disables */
+#ifndef STACKVECTOR_PREFETCH_DISTANCE
+#define STACKVECTOR_PREFETCH_DISTANCE 8
+#endif
+
+/* Prefetches the object memory[index + distance] points to; a no-op for non-pointer elements */
+template <typename M> inline typename std::enable_if<std::is_pointer<M>::value>::type stackPrefetchAhead(M const *memory, const size_t index, const size_t count, const size_t distance)
+{
+	if (distance && index + distance < count)
+		__builtin_prefetch((const void *)memory[index + distance]);
+}
+
+template <typename M> inline typename std::enable_if<!std::is_pointer<M>::value>::type stackPrefetchAhead(M const *, const size_t, const size_t, const size_t)
+{
+}
+
+/* Heap tiers used when the stack can't take an allocation: malloc, or above mapThreshold() an
+** anonymous private mapping, optionally backed by huge pages. Mapped memory is known to read
+** as zeroes, so value-initialising trivial types there needs no construction pass at all and
+** untouched pages stay shared kernel zero pages. Change the settings at startup only. */
+
+class StackHeap
+{
+public:
+	static size_t &mapThreshold() { static size_t threshold = STACKVECTOR_MMAP_THRESHOLD; return threshold; }
+	static bool &mapHugePages() { static bool hugePages = STACKVECTOR_MMAP_HUGEPAGES; return hugePages; }
+	static StackHeapNuma &numaPlacement() { static StackHeapNuma placement = STACKVECTOR_NUMA; return placement; }
+
+	static void *allocate(const size_t bytes, bool &mapped)
+	{
+		mapped = false;
+#if defined(__linux__)
+		if (mapThreshold() && bytes >= mapThreshold())
+		{
+			void *memory = map(bytes);
+			if (memory)
+			{
+				mapped = true;
+				place(memory, bytes);
+				return memory;
+			}
+		}
+#endif
+		void *memory = malloc(bytes);
+		if (memory)
+			place(memory, bytes);
+		return memory;
+	}
+
+	// NUMA node the calling thread runs on, -1 if unknown
+	static int currentNode()
+	{
+#if defined(__linux__) && defined(SYS_getcpu)
+		unsigned cpu = 0, node = 0;
+		if (0 == syscall(SYS_getcpu, &cpu, &node, nullptr))
+			return int(node);
+#endif
+		return -1;
+	}
+
+	// Applies numaPlacement() to a freshly allocated, not yet constructed block
+	static void place(void *memory, const size_t bytes)
+	{
+#if defined(__linux__)
+		if (StackHeapNuma::None == numaPlacement() || bytes < STACKVECTOR_NUMA_MINBYTES)
+			return;
+
+		if (StackHeapNuma::Bind == numaPlacement())
+			bindToCurrentNode(memory, bytes);
+
+		StackProbe::prefault(memory, bytes, false, StackVectorPrefault::Always);
+#else
+		// MorphOS has no NUMA
+		(void)memory; (void)bytes;
+#endif
+	}
+
+	static void release(void *memory, const size_t bytes, const bool mapped)
+	{
+#if defined(__linux__)
+		if (mapped)
+		{
+			munmap(memory, mappedSize(bytes));
+			return;
+		}
+#endif
+		(void)bytes; (void)mapped;
+		free(memory);
+	}
+
+	/* Gives back the tail of a block beyond newBytes: mapped blocks drop their whole trailing
+	** pages, malloc blocks are realloc()ed if mayMove allows it. Returns the block, which only
+	** moves for malloc blocks; from then on newBytes is its size for release(). */
+	static void *shrink(void *memory, const size_t bytes, const size_t newBytes, const bool mapped, const bool mayMove)
+	{
+#if defined(__linux__)
+		if (mapped)
+		{
+			const size_t keep = mappedSize(newBytes);
+			if (keep < mappedSize(bytes))
+				munmap(static_cast<unsigned char *>(memory) + keep, mappedSize(bytes) - keep);
+			SVOUT("%s: unmapped tail of %p beyond %d\n", __PRETTY_FUNCTION__, memory, int(keep));
+			return memory;
+		}
+#endif
+		(void)bytes; (void)mapped;
+		if (mayMove && newBytes)
+		{
+			SVOUT("%s: realloc'ing %p to size %d\n", __PRETTY_FUNCTION__, memory, int(newBytes));
+			void *shrunk = realloc(memory, newBytes);
+			if (shrunk)
+				return shrunk;
+		}
+		return memory;
+	}
+
+	static size_t mappedSize(const size_t bytes)
+	{
+		const size_t page = StackProbe::pageSize();
+		return (bytes + page - 1) & ~(page - 1);
+	}
+
+protected:
+#if defined(__linux__)
+	// Values from <linux/mempolicy.h>, which can't be included next to libnuma's <numaif.h>
+	static const int MpolDefault = 0;
+	static const int MpolPreferred = 1;
+	static const int MpolMfMove = 2;
+
+	static bool bindToCurrentNode(void *memory, const size_t bytes)
+	{
+#if defined(SYS_mbind) && defined(SYS_get_mempolicy)
+		int policy = MpolDefault;
+		if (0 != syscall(SYS_get_mempolicy, &policy, nullptr, 0, nullptr, 0) || MpolDefault != policy)
+			return false;
+
+		const int node = currentNode();
+		unsigned long mask = 0;
+		if (node < 0 || node >= int(sizeof(mask) * 8))
+			return false;
+		mask = 1ul << node;
+
+		// only whole pages inside the block, the partial ones at the ends belong to neighbours too
+		const size_t page = StackProbe::pageSize();
+		const uintptr_t first = (uintptr_t(memory) + page - 1) & ~uintptr_t(page - 1);
+		const uintptr_t last = (uintptr_t(memory) + bytes) & ~uintptr_t(page - 1);
+		if (last <= first)
+			return false;
+
+		// the kernel reads maxnode - 1 bits
+		const bool bound = 0 == syscall(SYS_mbind, first, last - first, MpolPreferred, &mask, sizeof(mask) * 8 + 1, MpolMfMove);
+		SVOUT("%s: bound %p-%p to node %d: %d\n", __PRETTY_FUNCTION__, (void *)first, (void *)last, node, bound);
+		return bound;
 #else
-#define SVOUT(...)
+		(void)memory; (void)bytes;
+		return false;
+#endif
+	}
+
+	static void *map(const size_t bytes)
+	{
+		const size_t size = mappedSize(bytes);
+		const size_t hugePage = 2 * 1024 * 1024;
+
+		if (!mapHugePages() || size < hugePage)
+		{
+			void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			SVOUT("%s: mapped %p size %d\n", __PRETTY_FUNCTION__, memory, int(size));
+			return MAP_FAILED == memory ? nullptr : memory;
+		}
+
+		// over-map so the block can be trimmed to a huge page boundary, THP only kicks in for aligned ranges
+		unsigned char *raw = static_cast<unsigned char *>(mmap(nullptr, size + hugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (MAP_FAILED == static_cast<void *>(raw))
+			return nullptr;
+
+		unsigned char *aligned = reinterpret_cast<unsigned char *>((uintptr_t(raw) + hugePage - 1) & ~uintptr_t(hugePage - 1));
+		if (aligned > raw)
+			munmap(raw, aligned - raw);
+		if (raw + size + hugePage > aligned + size)
+			munmap(aligned + size, (raw + size + hugePage) - (aligned + size));
+#if defined(MADV_HUGEPAGE)
+		madvise(aligned, size, MADV_HUGEPAGE);
 #endif
+		SVOUT("%s: mapped %p size %d with huge pages\n", __PRETTY_FUNCTION__, aligned, int(size));
+		return aligned;
+	}
+#endif
+};
 
 /* Helper class aiming to streamline creation of temporary vectors for OBArray object iterations 
 ** in ObjectiveC++ applications, but may have other uses too. The memory for the vector is allocated
@@ -37,68 +301,120 @@ extern "C" { void dprintf(const char *,...); };
 template <typename T> class StackVector
 {
 public:
-	/* MUST be inlined or alloca() would fail to survive past this method */
-	__attribute__((always_inline)) StackVector(const size_t size, const size_t mustLeaveStackSizeForScope = (16 * 1024), bool callConstructorsDestructors = true)
-		: _size(size), _callFree(false), _callConstructorsDestructors(callConstructorsDestructors)
+	/* MUST be inlined or alloca() would fail to survive past this method.
+	** With lazyConstruction, elements of non-trivial T are only constructed once operator[] or an
+	** iteration first reaches them, so early-exit searches don't pay for the untouched tail. */
+	__attribute__((always_inline)) StackVector(const size_t size, const size_t mustLeaveStackSizeForScope = (16 * 1024), bool callConstructorsDestructors = true, StackVectorPrefault prefault = StackVectorPrefault::None, bool lazyConstruction = false STACKVECTOR_PROFILE_WHERE)
+		: _size(size), _constructed(size), _callFree(false), _mapped(false), _onStack(false), _callConstructorsDestructors(callConstructorsDestructors)
+#if defined(STACKVECTOR_PROFILE)
+		, _profileSite(StackProfiler::site(where)), _profileStart(StackProfiler::now())
+#endif
 	{
 		const size_t needBytes = size * sizeof(T);
 		bool onStack = canReserveStack(needBytes, mustLeaveStackSizeForScope) ;
 
 		if (onStack) {
 #if defined(DEBUG) && DEBUG
-			struct Task *t = FindTask(NULL);
-			ULONG usedStack = 0, usedStackAfterAlloca = 0;
-			NewGetTaskAttrsA(t, &usedStack, sizeof (usedStack), TASKINFOTYPE_USEDSTACKSIZE, NULL);
+			uintptr_t before = 0, after = 0;
+			StackProbe::current(before);
 			_memory = static_cast<T*>(alloca(needBytes));
-			NewGetTaskAttrsA(t, &usedStackAfterAlloca, sizeof (usedStackAfterAlloca), TASKINFOTYPE_USEDSTACKSIZE, NULL);
-			SVOUT("%s: allocated on stack %p, alloca using stack? %d stack usage grew by %d\n", __PRETTY_FUNCTION__, _memory, isAllocatedOnStack(), usedStackAfterAlloca - usedStack);
+			StackProbe::current(after);
+			SVOUT("%s: allocated on stack %p, alloca using stack? %d stack usage grew by %d\n", __PRETTY_FUNCTION__, _memory, isAllocatedOnStack(), int(before - after));
 #else
 			_memory = static_cast<T*>(alloca(needBytes));
+#endif
+			_onStack = true;
+#if defined(STACKVECTOR_WATERMARK)
+			StackWatermark::reserve(_memory, needBytes);
 #endif
 		}
 		else {
-			_memory = static_cast<T*>(malloc(needBytes));
+			bool mapped = false;
+			_memory = static_cast<T*>(StackHeap::allocate(needBytes, mapped));
 			_callFree = true;
-			SVOUT("%s: allocated on heap %p\n", __PRETTY_FUNCTION__, _memory);
+			_mapped = mapped;
+			SVOUT("%s: allocated on heap %p mapped %d\n", __PRETTY_FUNCTION__, _memory, mapped);
+		}
+
+		if (_memory) {
+			StackProbe::prefault(_memory, needBytes, onStack, prefault);
 		}
 		
-		if (_callConstructorsDestructors && _memory) {
-			for (size_t i = 0; i < size; i++) {
-				new (&_memory[i]) T ();
+		// fresh mappings are already zero, which is what T() yields for trivial types
+		if (_callConstructorsDestructors && _memory && !(_mapped && std::is_trivially_default_constructible<T>::value)) {
+			if (lazyConstruction && !std::is_trivially_default_constructible<T>::value) {
+				_constructed = 0;
+			}
+			else {
+				for (size_t i = 0; i < size; i++) {
+					new (&_memory[i]) T ();
+				}
 			}
 		}
+
+#if defined(STACKVECTOR_PROFILE)
+		_profileSite->recordConstruction(needBytes, onStack, StackProfiler::now() - _profileStart);
+#endif
 	}
 	
+	/* Bulk construction from [first, last) or a span, copied straight into the new storage: memcpy
+	** for trivially copyable T read through a pointer, copy construction otherwise (pass
+	** std::move_iterators to move instead). No element is default constructed first. */
+	template <typename I, typename = typename std::enable_if<StackForwardIterator<I>::value>::type> __attribute__((always_inline)) StackVector(I first, I last, const size_t mustLeaveStackSizeForScope = (16 * 1024), StackVectorPrefault prefault = StackVectorPrefault::None STACKVECTOR_PROFILE_WHERE)
+		: StackVector(size_t(std::distance(first, last)), mustLeaveStackSizeForScope, false, prefault, false STACKVECTOR_PROFILE_PASS)
+	{
+		if (_memory) {
+			copyConstruct(_memory, first, last, _size);
+			// only now, so a throwing copy constructor leaves nothing for the destructor to undo
+			_callConstructorsDestructors = true;
+		}
+	}
+
+	template <typename U> __attribute__((always_inline)) StackVector(const StackSpan<U> &source, const size_t mustLeaveStackSizeForScope = (16 * 1024), StackVectorPrefault prefault = StackVectorPrefault::None STACKVECTOR_PROFILE_WHERE)
+		: StackVector(source.begin(), source.end(), mustLeaveStackSizeForScope, prefault STACKVECTOR_PROFILE_PASS)
+	{
+	}
+
 	StackVector() = delete;
 	
 	~StackVector()
 	{
-		if (_callConstructorsDestructors && _memory) {
-			for (size_t i = 0; i < _size; i++) {
-				(&_memory[i])->~T();
-			}
-		}
+		destroyFrom(0);
 
 		if (_callFree)
 		{
 			SVOUT("%s: freeing heap %p..\n", __PRETTY_FUNCTION__, _memory);
-			free(_memory);
+			StackHeap::release(_memory, _size * sizeof(T), _mapped);
 		}
 		else
 		{
 			SVOUT("%s: memory was alloca'd\n", __PRETTY_FUNCTION__);
+#if defined(STACKVECTOR_WATERMARK)
+			if (_onStack)
+				StackWatermark::release(_size * sizeof(T));
+#endif
 		}
+
+#if defined(STACKVECTOR_PROFILE)
+		if (_profileSite)
+			_profileSite->recordDestruction(StackProfiler::now() - _profileStart);
+#endif
 	}
 
 	size_t count() const { return _size; }
 	bool isValid() const { return _memory != nullptr && _size > 0; }
+	// True if the heap tier mapped the memory directly instead of using malloc()
+	bool isMapped() const { return _mapped; }
+	// Elements constructed so far, always count() unless lazyConstruction was requested
+	size_t constructedCount() const { return _constructed; }
 
 	// Invalid when called from another thread than the one that constructed the object
-	bool isAllocatedOnStack() const { return isStackAddress(FindTask(0), _memory); }
+	bool isAllocatedOnStack() const { return isStackAddress(_memory); }
 
 	// Iterates over the vector using a lambda
 	void forEach(std::function<void(T& member, size_t index)>&& onEach) {
 		if (_memory) {
+			constructUpTo(_size);
 			for (size_t idx = 0; idx < _size; idx++) {
 				onEach(_memory[idx], idx);
 			}
@@ -107,6 +423,7 @@ public:
 	
 	void forEach(std::function<void(const T& member, size_t index)>&& onEach) const {
 		if (_memory) {
+			constructUpTo(_size);
 			for (size_t idx = 0; idx < _size; idx++) {
 				onEach(_memory[idx], idx);
 			}
@@ -116,6 +433,8 @@ public:
 	void whileEach(std::function<bool(T& member, size_t index)>&& onEach) {
 		if (_memory) {
 			for (size_t idx = 0; idx < _size; idx++) {
+				if (!std::is_trivially_default_constructible<T>::value && __builtin_expect(idx >= _constructed, 0))
+					constructUpTo(idx + 1);
 				if (!onEach(_memory[idx], idx))
 					break;
 			}
@@ -125,12 +444,93 @@ public:
 	void whileEach(std::function<bool(const T& member, size_t index)>&& onEach) const {
 		if (_memory) {
 			for (size_t idx = 0; idx < _size; idx++) {
+				if (!std::is_trivially_default_constructible<T>::value && __builtin_expect(idx >= _constructed, 0))
+					constructUpTo(idx + 1);
+				if (!onEach(_memory[idx], idx))
+					break;
+			}
+		}
+	}
+
+	/* forEach/whileEach for vectors of object pointers (IDVector, OBString* etc): each step also
+	** prefetches the object distance elements ahead, so the callback doesn't stall on a cache miss
+	** for every scattered heap object. Tune distance so that it covers the miss latency. */
+	template <typename U = T> typename std::enable_if<std::is_pointer<U>::value>::type forEachPrefetched(std::function<void(T& member, size_t index)>&& onEach, const size_t distance = STACKVECTOR_PREFETCH_DISTANCE) {
+		if (_memory) {
+			for (size_t idx = 0; idx < _size; idx++) {
+				stackPrefetchAhead(_memory, idx, _size, distance);
+				onEach(_memory[idx], idx);
+			}
+		}
+	}
+
+	template <typename U = T> typename std::enable_if<std::is_pointer<U>::value>::type whileEachPrefetched(std::function<bool(T& member, size_t index)>&& onEach, const size_t distance = STACKVECTOR_PREFETCH_DISTANCE) {
+		if (_memory) {
+			for (size_t idx = 0; idx < _size; idx++) {
+				stackPrefetchAhead(_memory, idx, _size, distance);
 				if (!onEach(_memory[idx], idx))
 					break;
 			}
 		}
 	}
 
+	/* Overwrites elements from offset on with [first, last), memmove for trivially copyable T read
+	** through a pointer so the source may overlap this vector. Stops at count(); returns the
+	** number of elements written. Unconstructed lazy elements are copy constructed instead. */
+	template <typename I> typename std::enable_if<StackForwardIterator<I>::value, size_t>::type assign(I first, I last, const size_t offset = 0) {
+		if (!_memory || offset >= _size)
+			return 0;
+
+		size_t count = size_t(std::distance(first, last));
+		if (count > _size - offset)
+			count = _size - offset;
+		last = first;
+		std::advance(last, count);
+
+		constructUpTo(offset);
+		const size_t assigned = _constructed > offset ? std::min(count, _constructed - offset) : 0;
+		I split = first;
+		std::advance(split, assigned);
+
+		copyAssign(_memory + offset, first, split, assigned);
+		if (assigned < count) {
+			copyConstruct(_memory + offset + assigned, split, last, count - assigned);
+			_constructed = offset + count;
+		}
+		return count;
+	}
+
+	template <typename U> size_t assign(const StackSpan<U> &source, const size_t offset = 0) {
+		return assign(source.begin(), source.end(), offset);
+	}
+
+	/* Cuts a heap backed vector down to newSize elements, destroying the ones beyond and giving the
+	** memory behind them back: whole pages of a mapped block, via realloc() for trivially copyable
+	** T, or else by moving the elements into a smaller block; the elements may move in the latter
+	** two cases. Stack and adopted storage can't give anything back, and neither can a block of
+	** other T whose elements aren't constructed by the vector; those vectors are left untouched.
+	** Returns true if the vector shrank. */
+	bool shrink(const size_t newSize) {
+		if (!_callFree || !_memory || newSize >= _size)
+			return false;
+
+		if (newSize && !_mapped && !std::is_trivially_copyable<T>::value)
+			return reallocate(newSize, std::integral_constant<bool, std::is_move_constructible<T>::value>());
+
+		destroyFrom(newSize);
+
+		if (0 == newSize) {
+			StackHeap::release(_memory, _size * sizeof(T), _mapped);
+			_memory = nullptr;
+			_callFree = false;
+		}
+		else {
+			_memory = static_cast<T*>(StackHeap::shrink(_memory, _size * sizeof(T), newSize * sizeof(T), _mapped, std::is_trivially_copyable<T>::value));
+		}
+		_size = newSize;
+		return true;
+	}
+
 	T& operator[](size_t index) {
 #ifdef STACKVECTORDEBUG
 		if (index >= _size)
@@ -138,6 +538,8 @@ public:
 			SVOUT("%s: Access at %d outside of size %d\n", __PRETTY_FUNCTION__, index, _size);
 		}
 #endif
+		if (!std::is_trivially_default_constructible<T>::value && __builtin_expect(index >= _constructed, 0) && index < _size)
+			constructUpTo(index + 1);
 		return _memory[index];
 	}
 	
@@ -148,43 +550,326 @@ public:
 			SVOUT("%s: Access at %d outside of size %d\n", __PRETTY_FUNCTION__, index, _size);
 		}
 #endif
+		if (!std::is_trivially_default_constructible<T>::value && __builtin_expect(index >= _constructed, 0) && index < _size)
+			constructUpTo(index + 1);
 		return _memory[index];
 	}
 
 protected:
+	/* For subclasses that obtain storage elsewhere; callFree hands heap memory over to be free()'d */
+	StackVector(T *memory, const size_t size, bool callConstructorsDestructors, bool callFree)
+		: _memory(memory), _size(size), _constructed(size), _callFree(callFree), _mapped(false), _onStack(false), _callConstructorsDestructors(callConstructorsDestructors)
+#if defined(STACKVECTOR_PROFILE)
+		, _profileSite(nullptr), _profileStart(0)
+#endif
+	{
+		if (_callConstructorsDestructors && _memory) {
+			for (size_t i = 0; i < size; i++) {
+				new (&_memory[i]) T ();
+			}
+		}
+	}
+
 	bool canReserveStack(const size_t size, const size_t mustLeaveStackSizeForScope) const
 	{
-		struct Task *t = FindTask(NULL);
-		if (isStackAddress(t, const_cast<StackVector<T>*>(this)))
+		uintptr_t lower, upper, current;
+		if (StackProbe::probe(lower, upper, current) && uintptr_t(this) > lower && uintptr_t(this) < upper)
 		{
-			ULONG usedStack = 0;
-			if (0 != NewGetTaskAttrsA(t, &usedStack, sizeof (usedStack), TASKINFOTYPE_USEDSTACKSIZE, NULL))
-			{
-				struct ETask *e = t->tc_ETask;
-				ULONG lower = ULONG(e->PPCSPLower);
-				ULONG current = ULONG(e->PPCSPUpper) - usedStack;
-			
-				SVOUT("%s: 'this' was allocated on stack; lower %p current %p current-size %p\n", __PRETTY_FUNCTION__, lower, current, current - size);
-			
-				if ((lower + mustLeaveStackSizeForScope) < (current - size))
-					return true;
-			}
+			SVOUT("%s: 'this' was allocated on stack; lower %p current %p current-size %p\n", __PRETTY_FUNCTION__, (void *)lower, (void *)current, (void *)(current - size));
+
+			if (size < current && (lower + mustLeaveStackSizeForScope) < (current - size))
+				return true;
 		}
 
 		return false;
 	}
 	
-	bool isStackAddress(struct Task *t, void *address) const
+	bool isStackAddress(void *address) const
+	{
+		return StackProbe::isStackAddress(address);
+	}
+
+	// Whether [first, last) can be copied as raw bytes
+	template <typename I> using BytewiseSource = std::integral_constant<bool, std::is_trivially_copyable<T>::value && std::is_pointer<I>::value
+		&& std::is_same<typename std::remove_cv<typename std::remove_pointer<I>::type>::type, T>::value>;
+
+	template <typename I> static void copyConstruct(T *target, I first, I last, const size_t count) {
+		copyConstruct(target, first, last, count, BytewiseSource<I>());
+	}
+
+	template <typename I> static void copyConstruct(T *target, I first, I, const size_t count, std::true_type) {
+		if (count)
+			memcpy(static_cast<void *>(target), first, count * sizeof(T));
+	}
+
+	template <typename I> static void copyConstruct(T *target, I first, I last, const size_t, std::false_type) {
+		std::uninitialized_copy(first, last, target);
+	}
+
+	template <typename I> static void copyAssign(T *target, I first, I last, const size_t count) {
+		copyAssign(target, first, last, count, BytewiseSource<I>());
+	}
+
+	template <typename I> static void copyAssign(T *target, I first, I, const size_t count, std::true_type) {
+		if (count)
+			memmove(static_cast<void *>(target), first, count * sizeof(T));
+	}
+
+	template <typename I> static void copyAssign(T *target, I first, I last, const size_t count, std::false_type) {
+		copyElements(target, first, last, count, std::is_pointer<I>());
+	}
+
+	// element by element, backwards when a pointer source overlaps the target from below
+	template <typename I> static void copyElements(T *target, I first, I last, const size_t count, std::true_type) {
+		if (count && first < target && target < first + count)
+			std::copy_backward(first, last, target + count);
+		else
+			std::copy(first, last, target);
+	}
+
+	template <typename I> static void copyElements(T *target, I first, I last, const size_t, std::false_type) {
+		std::copy(first, last, target);
+	}
+
+	// Lazy mode only, extends the constructed prefix to cover [0, upTo)
+	void constructUpTo(const size_t upTo) const
+	{
+		while (_constructed < upTo) {
+			new (&_memory[_constructed]) T ();
+			_constructed++;
+		}
+	}
+
+	// shrink() for T that realloc() can't move: moves the kept elements into a fresh heap block
+	bool reallocate(const size_t newSize, std::true_type /* move constructible */)
+	{
+		if (!_callConstructorsDestructors)
+			return false;
+
+		bool mapped = false;
+		T *memory = static_cast<T*>(StackHeap::allocate(newSize * sizeof(T), mapped));
+		if (!memory)
+			return false;
+
+		destroyFrom(newSize);
+		for (size_t i = 0; i < _constructed; i++) {
+			new (&memory[i]) T (std::move(_memory[i]));
+			(&_memory[i])->~T();
+		}
+		SVOUT("%s: moved %d elements from %p to %p\n", __PRETTY_FUNCTION__, int(_constructed), _memory, memory);
+		StackHeap::release(_memory, _size * sizeof(T), _mapped);
+		_memory = memory;
+		_mapped = mapped;
+		_size = newSize;
+		return true;
+	}
+
+	bool reallocate(const size_t, std::false_type /* move constructible */)
 	{
-		struct ETask *e = t->tc_ETask;
-		SVOUT("%s: lower %p upper %p addr %p \n", __PRETTY_FUNCTION__, e->PPCSPLower, e->PPCSPUpper, address);
-		return (address > e->PPCSPLower) && (address < e->PPCSPUpper);
+		return false;
+	}
+
+	// Destroys the constructed elements from index on; subclasses that release the storage
+	// themselves call destroyFrom(0) first, ~StackVector() then has nothing left to destroy
+	void destroyFrom(const size_t from)
+	{
+		if (_callConstructorsDestructors && _memory) {
+			for (size_t i = from; i < _constructed; i++) {
+				(&_memory[i])->~T();
+			}
+		}
+		if (_constructed > from)
+			_constructed = from;
 	}
 	
 	T       *_memory;
 	size_t   _size;
+	mutable size_t _constructed;
 	bool     _callFree : 1;
+	bool     _mapped : 1;
+	bool     _onStack : 1;
 	bool     _callConstructorsDestructors : 1;
+#if defined(STACKVECTOR_PROFILE)
+	StackProfileSite *_profileSite;
+	uint64_t          _profileStart;
+#endif
+};
+
+/* StackVector over memory the caller already owns (a reused member buffer, an mmap'd region),
+** so the same kernels run on stack, heap and adopted storage. The memory is never freed and must
+** outlive the view. With callConstructorsDestructors the view default constructs the elements
+** and destroys them again when it goes away; without, it works on whatever the buffer holds. */
+
+template <typename T> class StackVectorView : public StackVector<T>
+{
+public:
+	StackVectorView(T *memory, const size_t size, bool callConstructorsDestructors = false)
+		: StackVector<T>(memory, size, callConstructorsDestructors, false)
+	{
+	}
+
+	StackVectorView(const StackSpan<T> &span, bool callConstructorsDestructors = false)
+		: StackVector<T>(span.data, span.size, callConstructorsDestructors, false)
+	{
+	}
+
+	StackVectorView() = delete;
+	StackVectorView(const StackVectorView&) = delete;
+	StackVectorView& operator=(const StackVectorView&) = delete;
+	~StackVectorView() = default;
+};
+
+/* Enumeration sources
+** -------------------
+** SnapshotEnumerator (and StreamEnumerator in stackenumerator.h) accept anything that can be
+** wrapped in a source adapter exposing:
+**   size_t count() const;                                    // current number of elements
+**   void copy(O *into, size_t location, size_t length) const; // bulk copy of [location, location+length)
+** and optionally, for sources keeping their elements in one stable buffer:
+**   const O *contiguous() const;                             // that buffer, or nullptr
+** Standard containers (std::vector, std::deque, std::unordered_set, ...) and anything else with
+** size(), begin() and forward iterators are adapted automatically through ContainerSource,
+** which reports data() as contiguous storage where the container has it;
+** OBArraySource and MUIFamilySource cover the ObjectiveC collections. */
+
+template <typename C> struct ContainerSource
+{
+	typedef typename std::decay<decltype(*std::declval<const C&>().begin())>::type Element;
+	typedef decltype(std::declval<const C&>().begin()) Iterator;
+
+	const C &container;
+
+	size_t count() const { return container.size(); }
+	// Walks from begin() on every call: an iterator kept from the previous call can't be told apart
+	// from one the caller's edits in between have invalidated
+	template <typename O> void copy(O *into, size_t location, size_t length) const {
+		Iterator from = container.begin();
+		std::advance(from, location);
+		for (size_t idx = 0; idx < length; idx++, ++from)
+			into[idx] = *from;
+	}
+	const Element *contiguous() const { return contiguousData(container, 0); }
+
+	template <typename D> static auto contiguousData(const D &c, int) -> decltype(static_cast<const Element *>(c.data())) { return c.data(); }
+	static const Element *contiguousData(const C &, long) { return nullptr; }
+};
+
+/* Length of [location, location + length) once clamped to a source of count elements */
+inline size_t enumerationLength(const size_t count, const size_t location, const size_t length)
+{
+	return location < count ? std::min(length, count - location) : 0;
+}
+
+/* Contiguous storage of an adapter, nullptr unless it has a contiguous() yielding exactly const O* */
+template <typename A, typename O, typename = void> struct ContiguousSource
+{
+	static const O *of(const A &) { return nullptr; }
+};
+
+template <typename A, typename O> struct ContiguousSource<A, O, typename std::enable_if<std::is_same<decltype(std::declval<const A&>().contiguous()), const O *>::value>::type>
+{
+	static const O *of(const A &source) { return source.contiguous(); }
+};
+
+/* Tag for SnapshotEnumerator: the callback won't change the source, so contiguous storage may be
+** enumerated in place */
+struct StableSource { };
+
+/* Picks the adapter for S: S itself if it already has count() and a suitable copy(), ContainerSource
+** otherwise. copy() alone isn't enough, std::string has one taking (count, position). */
+template <typename S, typename O, typename = void> struct EnumerationSource
+{
+	typedef ContainerSource<S> Adapter;
+	static Adapter adapt(const S &source) { return Adapter{ source }; }
+};
+
+template <typename S, typename O> struct EnumerationSource<S, O, decltype(std::declval<const S&>().count(), std::declval<const S&>().copy(std::declval<O*>(), size_t(0), size_t(0)), void())>
+{
+	typedef const S &Adapter;
+	static const S &adapt(const S &source) { return source; }
+};
+
+/*
+** Snapshots a range of any enumeration source into a StackVector and runs the callback over the
+** copy, so the callback may freely mutate the source. Callbacks returning bool stop the
+** enumeration by returning false (whileEach), void callbacks always see every element (forEach).
+** Passing StableSource() first promises that the callback leaves the source alone; sources with
+** contiguous storage are then enumerated in place without any copy, and callbacks get const O&.
+** Example:
+**  std::unordered_set<std::string> names = ...;
+**  SnapshotEnumerator<std::string> each(names, [&names](std::string& name, size_t index) {
+**    if (name.empty()) names.erase(name);
+**  });
+*/
+
+template <typename O> class SnapshotEnumerator : protected StackVector<O>
+{
+public:
+	template <typename Source, typename Callback> __attribute__((always_inline)) SnapshotEnumerator(const Source &source, Callback && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: StackVector<O>(EnumerationSource<Source, O>::adapt(source).count(), 32 * 1024, !std::is_trivial<O>::value, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS) {
+		snapshot(EnumerationSource<Source, O>::adapt(source), 0, enumCallback);
+	};
+	// Enumerates [location, location + length), indexes passed to the callback start at 0
+	// A range reaching past the end of the source is clamped to it
+	template <typename Source, typename Callback> __attribute__((always_inline)) SnapshotEnumerator(const Source &source, size_t location, size_t length, Callback && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: StackVector<O>(enumerationLength(EnumerationSource<Source, O>::adapt(source).count(), location, length), 32 * 1024, !std::is_trivial<O>::value, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS) {
+		snapshot(EnumerationSource<Source, O>::adapt(source), location, enumCallback);
+	};
+	template <typename Source, typename Callback> __attribute__((always_inline)) SnapshotEnumerator(StableSource, const Source &source, Callback && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: StackVector<O>(direct(source) ? 0 : EnumerationSource<Source, O>::adapt(source).count(), 32 * 1024, !std::is_trivial<O>::value, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS) {
+		enumerate(source, 0, EnumerationSource<Source, O>::adapt(source).count(), enumCallback);
+	};
+	template <typename Source, typename Callback> __attribute__((always_inline)) SnapshotEnumerator(StableSource, const Source &source, size_t location, size_t length, Callback && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: StackVector<O>(direct(source) ? 0 : enumerationLength(EnumerationSource<Source, O>::adapt(source).count(), location, length), 32 * 1024, !std::is_trivial<O>::value, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS) {
+		enumerate(source, location, enumerationLength(EnumerationSource<Source, O>::adapt(source).count(), location, length), enumCallback);
+	};
+	SnapshotEnumerator() = delete;
+	~SnapshotEnumerator() = default;
+
+protected:
+	template <typename Source> static const O *direct(const Source &source) {
+		typedef typename std::decay<typename EnumerationSource<Source, O>::Adapter>::type Adapter;
+		return ContiguousSource<Adapter, O>::of(EnumerationSource<Source, O>::adapt(source));
+	}
+
+	template <typename Adapter, typename Callback> void snapshot(const Adapter &source, const size_t location, Callback &enumCallback) {
+		if (StackVector<O>::_memory && StackVector<O>::_size) {
+			source.copy(StackVector<O>::_memory, location, StackVector<O>::_size);
+			run(StackVector<O>::_memory, StackVector<O>::_size, enumCallback);
+		}
+	}
+
+	template <typename Source, typename Callback> void enumerate(const Source &source, const size_t location, const size_t length, Callback &enumCallback) {
+		const O *memory = direct(source);
+		if (memory) {
+			run(memory + location, length, enumCallback);
+		}
+		else if (StackVector<O>::_memory && StackVector<O>::_size) {
+			EnumerationSource<Source, O>::adapt(source).copy(StackVector<O>::_memory, location, StackVector<O>::_size);
+			run(const_cast<const O *>(StackVector<O>::_memory), StackVector<O>::_size, enumCallback);
+		}
+	}
+
+	template <typename M, typename Callback> static void run(M *memory, const size_t count, Callback &enumCallback) {
+		if (count)
+			run(memory, count, enumCallback, std::is_void<decltype(enumCallback(memory[0], size_t(0)))>());
+	}
+
+	// pointer payloads get their objects prefetched STACKVECTOR_PREFETCH_DISTANCE elements ahead
+	template <typename M, typename Callback> static void run(M *memory, const size_t count, Callback &enumCallback, std::true_type /* returns void */) {
+		for (size_t idx = 0; idx < count; idx++) {
+			stackPrefetchAhead(memory, idx, count, STACKVECTOR_PREFETCH_DISTANCE);
+			enumCallback(memory[idx], idx);
+		}
+	}
+
+	template <typename M, typename Callback> static void run(M *memory, const size_t count, Callback &enumCallback, std::false_type /* returns bool */) {
+		for (size_t idx = 0; idx < count; idx++) {
+			stackPrefetchAhead(memory, idx, count, STACKVECTOR_PREFETCH_DISTANCE);
+			if (!enumCallback(memory[idx], idx))
+				break;
+		}
+	}
 };
 
 #ifdef __OBJC__
@@ -195,7 +880,23 @@ protected:
 class IDVector : public StackVector<id>
 {
 public:
-	IDVector(size_t size) : StackVector<id>(size, 32 * 1024, false) { };
+	IDVector(size_t size STACKVECTOR_PROFILE_WHERE) : StackVector<id>(size, 32 * 1024, false, StackVectorPrefault::None, false STACKVECTOR_PROFILE_PASS) { };
+};
+
+template <typename O> struct OBArraySource
+{
+	OBArray *array;
+
+	size_t count() const { return [array count]; }
+	void copy(O *into, size_t location, size_t length) const { [array getObjects:into inRange:OBMakeRange(location, length)]; }
+};
+
+template <typename O> struct MUIFamilySource
+{
+	id<MUIFamily> family;
+
+	size_t count() const { return [family count]; }
+	void copy(O *into, size_t location, size_t length) const { [family getObjects:into inRange:OBMakeRange(location, length)]; }
 };
 
 /*
@@ -208,80 +909,49 @@ public:
 **    }
 **    return true; // keep going
 **  });
+** All four are SnapshotEnumerator over an OBArraySource or MUIFamilySource.
 */
 
-template <typename O> class FastEnumerator : protected StackVector<O> 
+template <typename O> class FastEnumerator : protected SnapshotEnumerator<O> 
 {
 public:
-	FastEnumerator(OBArray *arrayToEnumerate, std::function<bool(O& member, size_t index)> && enumCallback) : StackVector<O>([arrayToEnumerate count], 32 * 1024, false) {
-		if (StackVector<O>::_memory) {
-			[arrayToEnumerate getObjects:StackVector<O>::_memory];
-			StackVector<O>::whileEach(std::move(enumCallback));
-		}
-	};
-	FastEnumerator(OBArray *arrayToEnumerate, OBRange && range, std::function<bool(O& member, size_t index)> && enumCallback) : StackVector<O>(range.length, 32 * 1024, false) {
-		if (StackVector<O>::_memory) {
-			[arrayToEnumerate getObjects:StackVector<O>::_memory inRange:range];
-			StackVector<O>::whileEach(std::move(enumCallback));
-		}
-	};
+	FastEnumerator(OBArray *arrayToEnumerate, std::function<bool(O& member, size_t index)> && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: SnapshotEnumerator<O>(OBArraySource<O>{ arrayToEnumerate }, enumCallback STACKVECTOR_PROFILE_PASS) { };
+	FastEnumerator(OBArray *arrayToEnumerate, OBRange && range, std::function<bool(O& member, size_t index)> && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: SnapshotEnumerator<O>(OBArraySource<O>{ arrayToEnumerate }, range.location, range.length, enumCallback STACKVECTOR_PROFILE_PASS) { };
 	FastEnumerator() = delete;
 	~FastEnumerator() = default;
 };
 
-template <typename O> class FastFamilyEnumerator : protected StackVector<O> 
+template <typename O> class FastFamilyEnumerator : protected SnapshotEnumerator<O> 
 {
 public:
-	FastFamilyEnumerator(id<MUIFamily> arrayToEnumerate, std::function<bool(O& member, size_t index)> && enumCallback) : StackVector<O>([arrayToEnumerate count], 32 * 1024, false) {
-		if (StackVector<O>::_memory) {
-			[arrayToEnumerate getObjects:StackVector<O>::_memory];
-			StackVector<O>::whileEach(std::move(enumCallback));
-		}
-	};
-	FastFamilyEnumerator(id<MUIFamily> arrayToEnumerate, OBRange && range, std::function<bool(O& member, size_t index)> && enumCallback) : StackVector<O>(range.length, 32 * 1024, false) {
-		if (StackVector<O>::_memory) {
-			[arrayToEnumerate getObjects:StackVector<O>::_memory inRange:range];
-			StackVector<O>::whileEach(std::move(enumCallback));
-		}
-	};
+	FastFamilyEnumerator(id<MUIFamily> arrayToEnumerate, std::function<bool(O& member, size_t index)> && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: SnapshotEnumerator<O>(MUIFamilySource<O>{ arrayToEnumerate }, enumCallback STACKVECTOR_PROFILE_PASS) { };
+	FastFamilyEnumerator(id<MUIFamily> arrayToEnumerate, OBRange && range, std::function<bool(O& member, size_t index)> && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: SnapshotEnumerator<O>(MUIFamilySource<O>{ arrayToEnumerate }, range.location, range.length, enumCallback STACKVECTOR_PROFILE_PASS) { };
 	FastFamilyEnumerator() = delete;
 	~FastFamilyEnumerator() = default;
 };
 
-template <typename O> class FastForEach: protected StackVector<O> 
+template <typename O> class FastForEach: protected SnapshotEnumerator<O> 
 {
 public:
-	FastForEach(OBArray *arrayToEnumerate, std::function<void(O& member, size_t index)> && enumCallback) : StackVector<O>([arrayToEnumerate count], 32 * 1024, false) {
-		if (StackVector<O>::_memory) {
-			[arrayToEnumerate getObjects:StackVector<O>::_memory];
-			StackVector<O>::forEach(std::move(enumCallback));
-		}
-	};
-	FastForEach(OBArray *arrayToEnumerate, OBRange && range, std::function<void(O& member, size_t index)> && enumCallback) : StackVector<O>(range.length, 32 * 1024, false) {
-		if (StackVector<O>::_memory) {
-			[arrayToEnumerate getObjects:StackVector<O>::_memory inRange:range];
-			StackVector<O>::forEach(std::move(enumCallback));
-		}
-	};
+	FastForEach(OBArray *arrayToEnumerate, std::function<void(O& member, size_t index)> && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: SnapshotEnumerator<O>(OBArraySource<O>{ arrayToEnumerate }, enumCallback STACKVECTOR_PROFILE_PASS) { };
+	FastForEach(OBArray *arrayToEnumerate, OBRange && range, std::function<void(O& member, size_t index)> && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: SnapshotEnumerator<O>(OBArraySource<O>{ arrayToEnumerate }, range.location, range.length, enumCallback STACKVECTOR_PROFILE_PASS) { };
 	FastForEach() = delete;
 	~FastForEach() = default;
 };
 
-template <typename O> class FastFamilyForEach : protected StackVector<O> 
+template <typename O> class FastFamilyForEach : protected SnapshotEnumerator<O> 
 {
 public:
-	FastFamilyForEach(id<MUIFamily> arrayToEnumerate, std::function<void(O& member, size_t index)> && enumCallback) : StackVector<O>([arrayToEnumerate count], 32 * 1024, false) {
-		if (StackVector<O>::_memory) {
-			[arrayToEnumerate getObjects:StackVector<O>::_memory];
-			StackVector<O>::forEach(std::move(enumCallback));
-		}
-	};
-	FastFamilyForEach(id<MUIFamily> arrayToEnumerate, OBRange && range, std::function<void(O& member, size_t index)> && enumCallback) : StackVector<O>(range.length, 32 * 1024, false) {
-		if (StackVector<O>::_memory) {
-			[arrayToEnumerate getObjects:StackVector<O>::_memory inRange:range];
-			StackVector<O>::forEach(std::move(enumCallback));
-		}
-	};
+	FastFamilyForEach(id<MUIFamily> arrayToEnumerate, std::function<void(O& member, size_t index)> && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: SnapshotEnumerator<O>(MUIFamilySource<O>{ arrayToEnumerate }, enumCallback STACKVECTOR_PROFILE_PASS) { };
+	FastFamilyForEach(id<MUIFamily> arrayToEnumerate, OBRange && range, std::function<void(O& member, size_t index)> && enumCallback STACKVECTOR_PROFILE_WHERE)
+		: SnapshotEnumerator<O>(MUIFamilySource<O>{ arrayToEnumerate }, range.location, range.length, enumCallback STACKVECTOR_PROFILE_PASS) { };
 	FastFamilyForEach() = delete;
 	~FastFamilyForEach() = default;
 };
@@ -0,0 +1,168 @@
+
+/*
+Copyright 2020 Jacek Piszczek
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense,
+and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+IN THE SOFTWARE.
+
+*/
+#pragma once
+#include <cstdio>
+#include <cstdint>
+#include "stackprobe.h"
+
+/* Stack high-water mark sampling, a tool mode for sizing thread stacks (__stack, pthread stack
+** sizes) and StackVector reserves from data rather than by trial and error.
+** StackWatermark::paint() fills the unused part of the calling thread's stack with a pattern;
+** highWater() later finds the deepest word that got overwritten. Built with
+** -DSTACKVECTOR_WATERMARK, every on-stack StackVector also reports its reservation, giving
+** the peak of live StackVector stack bytes and a heatmap of the depths they were placed at.
+** Example, at the top of a thread function:
+**  StackWatermarkScope watermark("decoder thread"); // paints now, prints the report on exit
+** Painting commits the whole stack, so keep this out of production builds. The per thread
+** state uses thread_local. */
+
+#ifndef STACKVECTOR_WATERMARK_BUCKET
+#define STACKVECTOR_WATERMARK_BUCKET (4 * 1024)
+#endif
+
+#ifndef STACKVECTOR_WATERMARK_BUCKETS
+#define STACKVECTOR_WATERMARK_BUCKETS 64
+#endif
+
+class StackWatermark
+{
+public:
+	static const uintptr_t Pattern = uintptr_t(0xA5A5A5A5A5A5A5A5ull);
+
+	/* Paints from just below the caller's frame down to the end of the stack (or at most
+	** maxBytes), walking downwards so that a guard page is hit rather than jumped over */
+	__attribute__((noinline)) static void paint(const size_t maxBytes = SIZE_MAX)
+	{
+		State &state = threadState();
+		uintptr_t lower, upper;
+		if (!StackProbe::bounds(lower, upper))
+			return;
+
+		// keep clear of our own frame and of the red zone below it
+		uintptr_t from = (uintptr_t(__builtin_frame_address(0)) - 1024) & ~uintptr_t(sizeof(uintptr_t) - 1);
+		uintptr_t to = lower + StackProbe::pageSize();
+		if (from - to > maxBytes)
+			to = from - maxBytes;
+
+		for (uintptr_t p = from; p >= to; p -= sizeof(uintptr_t))
+			*reinterpret_cast<volatile uintptr_t *>(p) = Pattern;
+
+		state.lower = lower;
+		state.upper = upper;
+		state.paintedLow = to;
+		state.paintedHigh = from;
+	}
+
+	// Deepest stack use since paint(), in bytes from the top of the stack; 0 if nothing was painted
+	static size_t highWater()
+	{
+		const State &state = threadState();
+		if (0 == state.paintedHigh)
+			return 0;
+
+		uintptr_t p = state.paintedLow;
+		while (p <= state.paintedHigh && Pattern == *reinterpret_cast<volatile uintptr_t *>(p))
+			p += sizeof(uintptr_t);
+		return state.upper - p;
+	}
+
+	// Called by StackVector for every on-stack reservation when STACKVECTOR_WATERMARK is defined
+	static void reserve(const void *memory, const size_t bytes)
+	{
+		State &state = threadState();
+		uintptr_t lower, upper;
+		state.liveBytes += bytes;
+		if (state.liveBytes > state.peakLiveBytes)
+			state.peakLiveBytes = state.liveBytes;
+
+		if (StackProbe::bounds(lower, upper) && uintptr_t(memory) < upper) {
+			size_t bucket = (upper - uintptr_t(memory)) / STACKVECTOR_WATERMARK_BUCKET;
+			if (bucket >= STACKVECTOR_WATERMARK_BUCKETS)
+				bucket = STACKVECTOR_WATERMARK_BUCKETS - 1;
+			state.bucketCount[bucket]++;
+			state.bucketBytes[bucket] += bytes;
+		}
+	}
+
+	static void release(const size_t bytes)
+	{
+		threadState().liveBytes -= bytes;
+	}
+
+	static size_t peakLiveBytes() { return threadState().peakLiveBytes; }
+
+	static void report(FILE *out, const char *label)
+	{
+		const State &state = threadState();
+		const size_t used = highWater();
+		const size_t size = state.upper - state.lower;
+		const size_t suggested = ((used + used / 4 + 4095) / 4096) * 4096;
+
+		fprintf(out, "%s: stack %zu bytes, high water %zu bytes (%.1f%%), peak live StackVector stack %zu bytes (%.1f%% of high water)\n",
+			label, size, used, size ? 100.0 * used / size : 0.0, state.peakLiveBytes, used ? 100.0 * state.peakLiveBytes / used : 0.0);
+		fprintf(out, "%s: a stack of %zu bytes leaves 25%% headroom\n", label, suggested);
+
+		for (size_t bucket = 0; bucket < STACKVECTOR_WATERMARK_BUCKETS; bucket++) {
+			if (0 == state.bucketCount[bucket])
+				continue;
+			fprintf(out, "%s: depth %6zu-%-6zu KB %8zu StackVectors %10zu bytes %s\n", label,
+				bucket * STACKVECTOR_WATERMARK_BUCKET / 1024, (bucket + 1) * STACKVECTOR_WATERMARK_BUCKET / 1024,
+				state.bucketCount[bucket], state.bucketBytes[bucket], bucket == STACKVECTOR_WATERMARK_BUCKETS - 1 ? "(and deeper)" : "");
+		}
+	}
+
+protected:
+	struct State
+	{
+		uintptr_t lower;
+		uintptr_t upper;
+		uintptr_t paintedLow;
+		uintptr_t paintedHigh;
+		size_t    liveBytes;
+		size_t    peakLiveBytes;
+		size_t    bucketCount[STACKVECTOR_WATERMARK_BUCKETS];
+		size_t    bucketBytes[STACKVECTOR_WATERMARK_BUCKETS];
+	};
+
+	static State &threadState()
+	{
+		static thread_local State state = {};
+		return state;
+	}
+};
+
+/* Paints the stack on construction and prints the report to stderr on destruction */
+
+class StackWatermarkScope
+{
+public:
+	StackWatermarkScope(const char *label, const size_t maxBytes = SIZE_MAX) : _label(label)
+	{
+		StackWatermark::paint(maxBytes);
+	}
+
+	~StackWatermarkScope()
+	{
+		StackWatermark::report(stderr, _label);
+	}
+
+	StackWatermarkScope() = delete;
+	StackWatermarkScope(const StackWatermarkScope&) = delete;
+	StackWatermarkScope& operator=(const StackWatermarkScope&) = delete;
+
+protected:
+	const char *_label;
+};